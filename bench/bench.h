@@ -0,0 +1,55 @@
+/*
+ * Helpers shared by the benchmarks: a clock, a small deterministic random
+ * number generator that doesn't allocate, and the current size of the heap.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../buddy-malloc.h"
+
+static inline double now_seconds(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static uint64_t random_state = 88172645463325252ULL;
+
+static inline uint32_t random_next(void) {
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 7;
+  random_state ^= random_state << 17;
+  return (uint32_t)(random_state >> 16);
+}
+
+/*
+ * Return the number of bytes between the start of the heap and the break,
+ * which is the memory the allocator has taken from the kernel.
+ */
+static inline size_t heap_bytes(void) {
+  return (size_t)((char *)sbrk(0) - buddy_heap_base);
+}
+
+/*
+ * Return the resident set size of the process in bytes.
+ */
+static inline size_t resident_bytes(void) {
+  unsigned long pages = 0, resident = 0;
+  FILE *file = fopen("/proc/self/statm", "r");
+  if (file) {
+    if (fscanf(file, "%lu %lu", &pages, &resident) != 2) resident = 0;
+    fclose(file);
+  }
+  return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+#endif
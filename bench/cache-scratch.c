@@ -0,0 +1,55 @@
+/*
+ * Passive false sharing, after the benchmark of the same name from Hoard:
+ * the main thread allocates one small object for each thread, so they end
+ * up next to each other. Each thread frees its object and then repeatedly
+ * allocates a new one, writes to it and frees it. An allocator that reuses
+ * the freed object for the thread that freed it keeps the threads writing
+ * to one shared cache line.
+ */
+
+#include "bench.h"
+
+#include <pthread.h>
+
+#define THREADS 4
+#define ROUNDS 20000
+#define WRITES 1000
+#define OBJECT_SIZE 8
+
+static void *scratch(void *arg) {
+  volatile char *object;
+  int round, i;
+
+  free(arg);
+  for (round = 0; round < ROUNDS; round++) {
+    object = malloc(OBJECT_SIZE);
+    for (i = 0; i < WRITES; i++) {
+      object[i % OBJECT_SIZE]++;
+    }
+    free((void *)object);
+  }
+  return NULL;
+}
+
+int main(void) {
+  pthread_t threads[THREADS];
+  void *objects[THREADS];
+  double start;
+  int t;
+
+  for (t = 0; t < THREADS; t++) {
+    objects[t] = malloc(OBJECT_SIZE);
+  }
+
+  start = now_seconds();
+  for (t = 0; t < THREADS; t++) {
+    pthread_create(&threads[t], NULL, scratch, objects[t]);
+  }
+  for (t = 0; t < THREADS; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  start = now_seconds() - start;
+
+  printf("%.3f ns/write (%d threads)\n", start / ((double)THREADS * ROUNDS * WRITES) * 1e9, THREADS);
+  return 0;
+}
@@ -0,0 +1,49 @@
+/*
+ * Active false sharing, after the benchmark of the same name from Hoard:
+ * several threads each allocate a small object, write to it many times and
+ * free it, over and over. An allocator that hands objects on the same cache
+ * line to different threads makes the line move between cores on every
+ * write.
+ */
+
+#include "bench.h"
+
+#include <pthread.h>
+
+#define THREADS 4
+#define ROUNDS 20000
+#define WRITES 1000
+#define OBJECT_SIZE 8
+
+static void *thrash(void *arg) {
+  volatile char *object;
+  int round, i;
+
+  (void)arg;
+  for (round = 0; round < ROUNDS; round++) {
+    object = malloc(OBJECT_SIZE);
+    for (i = 0; i < WRITES; i++) {
+      object[i % OBJECT_SIZE]++;
+    }
+    free((void *)object);
+  }
+  return NULL;
+}
+
+int main(void) {
+  pthread_t threads[THREADS];
+  double start;
+  int t;
+
+  start = now_seconds();
+  for (t = 0; t < THREADS; t++) {
+    pthread_create(&threads[t], NULL, thrash, NULL);
+  }
+  for (t = 0; t < THREADS; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  start = now_seconds() - start;
+
+  printf("%.3f ns/write (%d threads)\n", start / ((double)THREADS * ROUNDS * WRITES) * 1e9, THREADS);
+  return 0;
+}
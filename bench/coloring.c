@@ -0,0 +1,44 @@
+/*
+ * Stream through several equal-sized buffers at once, adding up one element
+ * of each buffer per step like a multi-way merge. Without cache coloring,
+ * the buffers all start at the same offset within a large block, so the
+ * elements read together compete for the same cache sets.
+ */
+
+#include "bench.h"
+
+#define BUFFERS 32
+#define ELEMENTS (16384 / sizeof(size_t))
+#define PASSES 200
+#define RUNS 10
+
+static size_t *buffers[BUFFERS];
+
+int main(void) {
+  size_t i, b, pass, run, sum;
+  double start, best = 1e9;
+
+  for (b = 0; b < BUFFERS; b++) {
+    buffers[b] = malloc(ELEMENTS * sizeof(size_t));
+    for (i = 0; i < ELEMENTS; i++) {
+      buffers[b][i] = i;
+    }
+  }
+
+  for (run = 0; run < RUNS; run++) {
+    start = now_seconds();
+    for (pass = 0, sum = 0; pass < PASSES; pass++) {
+      for (i = 0; i < ELEMENTS; i++) {
+        for (b = 0; b < BUFFERS; b++) {
+          sum += buffers[b][i];
+        }
+      }
+    }
+    if (sum != (size_t)PASSES * BUFFERS * ELEMENTS * (ELEMENTS - 1) / 2) abort();
+    start = now_seconds() - start;
+    if (start < best) best = start;
+  }
+
+  printf("%.3f ns/element (best of %d runs)\n", best / ((double)PASSES * BUFFERS * ELEMENTS) * 1e9, RUNS);
+  return 0;
+}
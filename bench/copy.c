@@ -0,0 +1,69 @@
+/*
+ * Compare moving a block with "realloc" against "memcpy" into a fresh
+ * buffer, and clearing dirty memory with "calloc" against "memset", for
+ * sizes from 64kb to 256mb, in gigabytes per second. Sizes stop at 256mb
+ * because the moved block, its neighbor and the new block have to fit in
+ * the 2gb heap together. "bench/run.sh" also builds this without the
+ * streaming kernels and "mremap", which makes "realloc" and "calloc" use
+ * plain "memcpy" and "memset".
+ */
+
+#include "bench.h"
+
+#include <string.h>
+
+#define BYTES_PER_SIZE ((size_t)1 << 30)
+
+/* Leave room for the block header so that each request fills its bucket */
+#define FIT(size) ((size) - 64)
+
+static char *volatile block, *volatile neighbor, *volatile other;
+
+static double rate(size_t bytes, double seconds) {
+  return bytes / seconds * 1e-9;
+}
+
+int main(void) {
+  size_t size, rep, reps;
+  double start, moved, copied, cleared, set;
+
+  printf("\n");
+  for (size = 64 << 10; size <= 256 << 20; size <<= 2) {
+    reps = BYTES_PER_SIZE / size;
+    moved = copied = cleared = set = 0;
+
+    for (rep = 0; rep < reps; rep++) {
+      /* The neighbor keeps the block from growing in place */
+      block = malloc(FIT(size));
+      neighbor = malloc(FIT(size));
+      if (!block || !neighbor) abort();
+      memset(block, 1, FIT(size));
+      start = now_seconds();
+      block = realloc(block, FIT(size * 2));
+      moved += now_seconds() - start;
+      free(neighbor);
+
+      other = malloc(FIT(size * 2));
+      memset(other, 1, FIT(size));
+      start = now_seconds();
+      memcpy(other, block, FIT(size));
+      copied += now_seconds() - start;
+      free(other);
+
+      /* The block is dirty now, so "calloc" has to clear it */
+      free(block);
+      start = now_seconds();
+      block = calloc(FIT(size * 2), 1);
+      cleared += now_seconds() - start;
+      start = now_seconds();
+      memset(block, 0, FIT(size * 2));
+      set += now_seconds() - start;
+      free(block);
+    }
+
+    printf("  %6zukb: realloc %5.1f, memcpy %5.1f, calloc %5.1f, memset %5.1f GB/s\n", size >> 10,
+      rate(FIT(size) * reps, moved), rate(FIT(size) * reps, copied),
+      rate(FIT(size * 2) * reps, cleared), rate(FIT(size * 2) * reps, set));
+  }
+  return 0;
+}
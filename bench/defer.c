@@ -0,0 +1,62 @@
+/*
+ * Build a large linked list of small nodes in random order and tear it
+ * down, either with "free" or with "free_deferred" followed by
+ * "buddy_flush_deferred". Reports the time per node spent in the teardown
+ * loop itself and the total including the flush.
+ */
+
+#include "bench.h"
+
+#ifndef DEFERRED
+#define DEFERRED 0
+#endif
+
+#define NODES (1 << 20)
+#define RUNS 5
+
+struct node {
+  struct node *next;
+  char payload[24];
+};
+
+static struct node *nodes[NODES];
+
+int main(void) {
+  struct node *list, *next;
+  double start, loop, total, best_loop = 1e9, best_total = 1e9;
+  size_t i, j, run;
+
+  for (run = 0; run < RUNS; run++) {
+    for (i = 0; i < NODES; i++) {
+      nodes[i] = malloc(sizeof(struct node) + random_next() % 64);
+    }
+    for (i = NODES - 1; i > 0; i--) {
+      struct node *swap;
+      j = random_next() % (i + 1);
+      swap = nodes[i], nodes[i] = nodes[j], nodes[j] = swap;
+    }
+    for (i = 0, list = NULL; i < NODES; i++) {
+      nodes[i]->next = list;
+      list = nodes[i];
+    }
+
+    start = now_seconds();
+    for (; list; list = next) {
+      next = list->next;
+#if DEFERRED
+      free_deferred(list);
+#else
+      free(list);
+#endif
+    }
+    loop = now_seconds() - start;
+    buddy_flush_deferred();
+    total = now_seconds() - start;
+    if (loop < best_loop) best_loop = loop;
+    if (total < best_total) best_total = total;
+  }
+
+  printf("%.1f ns/node in the loop, %.1f ns/node in total (best of %d runs)\n",
+    best_loop / NODES * 1e9, best_total / NODES * 1e9, RUNS);
+  return 0;
+}
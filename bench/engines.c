@@ -0,0 +1,43 @@
+/*
+ * Time the same allocation patterns with each engine. "bench/run.sh" builds
+ * this once per engine and once per option that changes how the default
+ * engine lays out its state, so the numbers can be compared line by line.
+ *
+ *   - "same": free and reallocate blocks of one small size, which reuses
+ *     the most recently freed block.
+ *   - "mixed": a random working set of sizes from 16 bytes to 4kb.
+ *   - "large": a random working set of 256 sizes from 4kb to 1mb, which
+ *     splits and merges across many buckets.
+ */
+
+#include "bench.h"
+
+#define SLOTS 4096
+#define STEPS 4000000
+
+static void *slots[SLOTS];
+
+static double churn(size_t count, size_t min_size, size_t max_size, size_t steps) {
+  double start = now_seconds();
+  size_t step, slot;
+
+  for (step = 0; step < steps; step++) {
+    slot = random_next() % count;
+    free(slots[slot]);
+    slots[slot] = malloc(min_size + random_next() % (max_size - min_size + 1));
+    *(volatile char *)slots[slot] = 1;
+  }
+  for (slot = 0; slot < count; slot++) {
+    free(slots[slot]);
+    slots[slot] = NULL;
+  }
+  return (now_seconds() - start) / steps * 1e9;
+}
+
+int main(void) {
+  double same = churn(SLOTS, 24, 24, STEPS);
+  double mixed = churn(SLOTS, 16, 4096, STEPS);
+  double large = churn(256, 4096, 1 << 20, STEPS / 16);
+  printf("same %.1f ns/op, mixed %.1f ns/op, large %.1f ns/op\n", same, mixed, large);
+  return 0;
+}
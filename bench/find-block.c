@@ -0,0 +1,35 @@
+/*
+ * Time "buddy_find_block" for random pointers into a million live blocks
+ * of mixed sizes, which is the lookup a conservative collector or a
+ * debugging tool does for every pointer it finds.
+ */
+
+#include "bench.h"
+
+#define BLOCKS (1 << 20)
+#define LOOKUPS 10000000
+
+static char *blocks[BLOCKS];
+static size_t sizes[BLOCKS];
+
+int main(void) {
+  size_t i, found = 0, size;
+  double start;
+  void *block;
+
+  for (i = 0; i < BLOCKS; i++) {
+    sizes[i] = random_next() % 16 ? 16 + random_next() % 200 : 1 + random_next() % 16384;
+    blocks[i] = malloc(sizes[i]);
+  }
+
+  start = now_seconds();
+  for (i = 0; i < LOOKUPS; i++) {
+    size_t index = random_next() % BLOCKS;
+    found += buddy_find_block(blocks[index] + random_next() % sizes[index], &block, &size);
+  }
+  if (found != LOOKUPS) abort();
+
+  printf("%.1f ns/lookup in a %.0fmb heap\n", (now_seconds() - start) / LOOKUPS * 1e9,
+    heap_bytes() / 1048576.0);
+  return 0;
+}
@@ -0,0 +1,61 @@
+/*
+ * Measure how much memory a long-running program keeps. The live set grows
+ * to a peak and then shrinks to a tenth of it several times, and a few
+ * blocks allocated after each shrink live until the end. At the end, the
+ * bytes past the highest long-lived block could be given back by lowering
+ * the break, so a placement policy that keeps the live set packed toward
+ * the start of the heap leaves more of them.
+ */
+
+#include "bench.h"
+
+#define SLOTS 65536
+#define ROUNDS 8
+#define KEPT (SLOTS / 16)
+
+static void *slots[SLOTS];
+static void *kept[KEPT];
+
+int main(void) {
+  size_t round, slot, live = 0, peak_heap = 0, peak_resident = 0;
+  char *end, *highest = buddy_heap_base;
+
+  for (round = 0; round < ROUNDS; round++) {
+    /* Fill every slot, replacing random ones along the way */
+    for (slot = 0; slot < SLOTS * 4; slot++) {
+      size_t index = random_next() % SLOTS;
+      free(slots[index]);
+      slots[index] = malloc(16 + random_next() % (random_next() % 8 ? 256 : 16384));
+      *(volatile char *)slots[index] = 1;
+    }
+    if (heap_bytes() > peak_heap) peak_heap = heap_bytes();
+    if (resident_bytes() > peak_resident) peak_resident = resident_bytes();
+
+    /* Shrink to about a tenth */
+    for (slot = 0; slot < SLOTS; slot++) {
+      if (random_next() % 10) {
+        free(slots[slot]);
+        slots[slot] = NULL;
+      }
+    }
+
+    /* Allocate a few long-lived blocks while the live set is small */
+    for (slot = 0; slot < KEPT / ROUNDS; slot++) {
+      kept[live] = malloc(16 + random_next() % 256);
+      *(volatile char *)kept[live++] = 1;
+    }
+  }
+
+  for (slot = 0; slot < SLOTS; slot++) {
+    free(slots[slot]);
+  }
+  for (slot = 0; slot < live; slot++) {
+    end = (char *)kept[slot] + 16;
+    if (end > highest) highest = end;
+  }
+
+  printf("peak heap %zukb, peak rss %zukb, final heap %zukb, trimmable %zukb, live blocks %zu\n",
+    peak_heap >> 10, peak_resident >> 10, heap_bytes() >> 10,
+    (size_t)((char *)sbrk(0) - highest) >> 10, live);
+  return 0;
+}
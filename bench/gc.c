@@ -0,0 +1,51 @@
+/*
+ * Time "buddy_gc_collect" on a heap with a live linked list and a growing
+ * amount of garbage. The pause is the time of one collection. A collection
+ * without garbage only marks, so the time a pause takes beyond that is
+ * spent sweeping, and the sweep rate is garbage blocks freed per second of
+ * that time.
+ */
+
+#include "bench.h"
+
+#define LIVE 100000
+
+struct node {
+  struct node *next;
+  size_t value;
+};
+
+static struct node *live;
+
+static void __attribute__((noinline)) make_garbage(size_t count) {
+  size_t i;
+  for (i = 0; i < count; i++) {
+    *(volatile char *)buddy_gc_malloc(16 + random_next() % 256) = 1;
+  }
+}
+
+int main(void) {
+  size_t i, garbage, freed;
+  double start, mark;
+
+  for (i = 0; i < LIVE; i++) {
+    struct node *node = buddy_gc_malloc(sizeof(struct node));
+    node->next = live;
+    live = node;
+  }
+
+  start = now_seconds();
+  buddy_gc_collect();
+  mark = now_seconds() - start;
+
+  printf("\n  %zu live: pause %.2f ms\n", (size_t)LIVE, mark * 1e3);
+  for (garbage = 100000; garbage <= 1600000; garbage *= 4) {
+    make_garbage(garbage);
+    start = now_seconds();
+    freed = buddy_gc_collect();
+    start = now_seconds() - start;
+    printf("  %zu live, %zu garbage: freed %zu, pause %.2f ms, sweep %.1f million blocks/s\n",
+      (size_t)LIVE, garbage, freed, start * 1e3, freed / (start - mark) * 1e-6);
+  }
+  return 0;
+}
@@ -0,0 +1,98 @@
+/*
+ * An LRU cache built from a chained hash table and a doubly linked recency
+ * list, with its links stored as pointers or, with "-DOFFSETS=1", as 32-bit
+ * offsets from "buddy_malloc32". Offsets shrink each entry from a 64-byte
+ * block to a 32-byte one and halve the bucket array. This reports the heap
+ * size and the time per lookup, where each hit moves the entry to the
+ * front of the recency list.
+ */
+
+#include "bench.h"
+
+#ifndef OFFSETS
+#define OFFSETS 0
+#endif
+
+#define ENTRIES (1 << 21)
+#define BUCKETS (1 << 21)
+#define LOOKUPS 20000000
+
+#if OFFSETS
+typedef uint32_t link_t;
+#define NODE(link) ((struct node *)buddy_ptr32(link))
+#define LINK(node) buddy_offset32(node)
+#define NEW_NODE() NODE(buddy_malloc32(sizeof(struct node)))
+#else
+typedef struct node *link_t;
+#define NODE(link) (link)
+#define LINK(node) (node)
+#define NEW_NODE() ((struct node *)malloc(sizeof(struct node)))
+#endif
+
+struct node {
+  link_t next;
+  link_t newer;
+  link_t older;
+  uint32_t key;
+  uint32_t value;
+};
+
+static link_t *buckets;
+/* The recency list is circular around a sentinel, newest first */
+static struct node *head;
+
+static uint32_t hash(uint32_t key) {
+  return (key * 2654435761u) >> (32 - 21);
+}
+
+static void unlink_node(struct node *node) {
+  NODE(node->newer)->older = node->older;
+  NODE(node->older)->newer = node->newer;
+}
+
+static void push_front(struct node *node) {
+  node->newer = LINK(head);
+  node->older = head->older;
+  NODE(head->older)->newer = LINK(node);
+  head->older = LINK(node);
+}
+
+static struct node *lookup(uint32_t key) {
+  struct node *node = NODE(buckets[hash(key)]);
+  while (node && node->key != key) {
+    node = NODE(node->next);
+  }
+  if (node) {
+    unlink_node(node);
+    push_front(node);
+  }
+  return node;
+}
+
+int main(void) {
+  size_t i, found = 0;
+  double start;
+
+  buckets = calloc(BUCKETS, sizeof(link_t));
+  head = NEW_NODE();
+  head->newer = head->older = LINK(head);
+  for (i = 0; i < ENTRIES; i++) {
+    struct node *node = NEW_NODE();
+    uint32_t slot;
+    node->key = (uint32_t)i * 7;
+    node->value = (uint32_t)i;
+    slot = hash(node->key);
+    node->next = buckets[slot];
+    buckets[slot] = LINK(node);
+    push_front(node);
+  }
+
+  start = now_seconds();
+  for (i = 0; i < LOOKUPS; i++) {
+    found += lookup((random_next() % ENTRIES) * 7) != NULL;
+  }
+  if (found != LOOKUPS) abort();
+
+  printf("%.1f ns/lookup in a %zumb heap\n", (now_seconds() - start) / LOOKUPS * 1e9, heap_bytes() >> 20);
+  return 0;
+}
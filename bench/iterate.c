@@ -0,0 +1,54 @@
+/*
+ * Time "buddy_iterate" over the whole heap with a million live blocks of
+ * mixed sizes, and again after freeing all but one in sixteen of them at
+ * random, when most of the tree is free subtrees that should be skipped.
+ */
+
+#include "bench.h"
+
+#define BLOCKS (1 << 20)
+#define RUNS 5
+
+static char *blocks[BLOCKS];
+
+static void count_bytes(void *ptr, size_t size, void *arg) {
+  (void)ptr;
+  *(size_t *)arg += size;
+}
+
+/*
+ * Return the best time per reported block of a few walks of the heap.
+ */
+static double time_iterate(void) {
+  double start, best = 1e9;
+  size_t run, count = 1, bytes = 0;
+
+  for (run = 0; run < RUNS; run++) {
+    start = now_seconds();
+    count = buddy_iterate(NULL, SIZE_MAX, count_bytes, &bytes);
+    start = now_seconds() - start;
+    if (start < best) best = start;
+  }
+  if (!bytes) abort();
+  return best / count * 1e9;
+}
+
+int main(void) {
+  size_t i;
+  double dense, sparse;
+
+  for (i = 0; i < BLOCKS; i++) {
+    blocks[i] = malloc(random_next() % 16 ? 16 + random_next() % 200 : 1 + random_next() % 16384);
+  }
+  dense = time_iterate();
+
+  for (i = 0; i < BLOCKS; i++) {
+    if (random_next() % 16) {
+      free(blocks[i]);
+    }
+  }
+  sparse = time_iterate();
+
+  printf("%.1f ns/block all live, %.1f ns/block with 1/16 live\n", dense, sparse);
+  return 0;
+}
@@ -0,0 +1,80 @@
+/*
+ * Time every "malloc" and "free" of a random workload with the cycle
+ * counter and report the worst case and the 99.99th percentile of each.
+ * The number of operations can be passed as an argument (the default is a
+ * million; the real-time configurations are meant to be checked with
+ * 100000000). Heap growth is part of the workload, so the worst cases
+ * include the system calls that grow the heap unless it's fixed.
+ */
+
+#include "bench.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CYCLES() __rdtsc()
+#else
+#define CYCLES() ((uint64_t)(now_seconds() * 1e9))
+#endif
+
+#define SLOTS 65536
+#define HISTOGRAM 64
+
+static void *slots[SLOTS];
+
+struct latency {
+  uint64_t max;
+  uint64_t count;
+  uint64_t histogram[HISTOGRAM];
+};
+
+static struct latency mallocs, frees;
+
+static void record(struct latency *latency, uint64_t cycles) {
+  size_t bucket = 0;
+  while (bucket + 1 < HISTOGRAM && cycles >> bucket) bucket++;
+  latency->histogram[bucket]++;
+  latency->count++;
+  if (cycles > latency->max) latency->max = cycles;
+}
+
+/*
+ * Return an upper bound for the given fraction of calls, rounded up to a
+ * power of two.
+ */
+static uint64_t percentile(const struct latency *latency, double fraction) {
+  uint64_t seen = 0;
+  size_t bucket;
+  for (bucket = 0; bucket < HISTOGRAM; bucket++) {
+    seen += latency->histogram[bucket];
+    if (seen >= latency->count * fraction) break;
+  }
+  return (uint64_t)1 << bucket;
+}
+
+int main(int argc, char **argv) {
+  uint64_t operations = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+  uint64_t i, start;
+  size_t slot, size;
+
+  for (i = 0; i < operations; i++) {
+    slot = random_next() % SLOTS;
+    if (slots[slot]) {
+      start = CYCLES();
+      free(slots[slot]);
+      record(&frees, CYCLES() - start);
+      slots[slot] = NULL;
+    } else {
+      size = random_next() % 16 ? 16 + random_next() % 256 : 1 + random_next() % 65536;
+      start = CYCLES();
+      slots[slot] = malloc(size);
+      record(&mallocs, CYCLES() - start);
+      if (!slots[slot]) abort();
+      *(volatile char *)slots[slot] = 1;
+    }
+  }
+
+  printf("malloc max %llu, 99.99%% < %llu; free max %llu, 99.99%% < %llu cycles\n",
+    (unsigned long long)mallocs.max, (unsigned long long)percentile(&mallocs, 0.9999),
+    (unsigned long long)frees.max, (unsigned long long)percentile(&frees, 0.9999));
+  return 0;
+}
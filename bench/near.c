@@ -0,0 +1,67 @@
+/*
+ * Build a linked list by inserting nodes after random existing nodes into a
+ * heap with holes all over it. Each node is allocated with "malloc_near"
+ * next to the node it follows, or with "malloc" when built with "-DNEAR=0".
+ * Then report the fastest of several walks over the list in order and how
+ * many steps of the walk stay within a 4kb page.
+ */
+
+#include "bench.h"
+
+#define NODES 262144
+#define WALKS 32
+
+#ifndef NEAR
+#define NEAR 1
+#endif
+
+struct node {
+  struct node *next;
+  size_t value;
+};
+
+static struct node *nodes[NODES];
+static void *filler[NODES * 4];
+
+int main(void) {
+  struct node head = { NULL, 0 };
+  size_t i, sum, walk, same_page = 0;
+  double start, best = 1e9;
+
+  /* Leave holes of up to 16 nodes all over the heap */
+  for (i = 0; i < NODES * 4; i++) {
+    filler[i] = malloc(sizeof(struct node));
+  }
+  for (i = 0; i < NODES * 4; i += 16) {
+    size_t j, holes = random_next() % 17;
+    for (j = 0; j < holes; j++) {
+      free(filler[i + j]);
+    }
+  }
+
+  for (i = 0; i < NODES; i++) {
+    struct node *prev = i ? nodes[random_next() % i] : &head;
+    struct node *node = NEAR && i ? malloc_near(prev, sizeof(struct node)) : malloc(sizeof(struct node));
+    node->next = prev->next;
+    node->value = i;
+    prev->next = node;
+    nodes[i] = node;
+  }
+
+  for (i = 0; i < NODES; i++) {
+    struct node *node = nodes[i];
+    if (node->next && ((uintptr_t)node >> 12) == ((uintptr_t)node->next >> 12)) same_page++;
+  }
+
+  for (walk = 0; walk < WALKS; walk++) {
+    struct node *node;
+    start = now_seconds();
+    for (node = head.next, sum = 0; node; node = node->next) sum += node->value;
+    if (sum != (size_t)NODES * (NODES - 1) / 2) abort();
+    start = now_seconds() - start;
+    if (start < best) best = start;
+  }
+  printf("%s %.2f ns/node, %.1f%% in the same page\n", NEAR ? "malloc_near" : "malloc",
+    best / NODES * 1e9, same_page * 100.0 / NODES);
+  return 0;
+}
@@ -0,0 +1,36 @@
+/*
+ * Churn a mix of small and large blocks and report what the statistics say
+ * about splitting: how many allocations failed, how often the tree grew,
+ * how many splits there were and how many of them found no block with an
+ * entirely used buddy. Built with "-DBUDDY_FIXED_HEAP_LOG2", the heap can't
+ * grow, so fragmentation shows up as failures instead of tree growth.
+ */
+
+#include "bench.h"
+
+#define SLOTS 4096
+#define STEPS (SLOTS * 64)
+
+static void *slots[SLOTS];
+
+int main(void) {
+  struct buddy_stats stats;
+  size_t step, bucket, failures = 0, growths = 0, splits = 0, unpreferred = 0;
+
+  for (step = 0; step < STEPS; step++) {
+    size_t index = random_next() % SLOTS;
+    free(slots[index]);
+    slots[index] = malloc(16 + random_next() % (random_next() % 10 ? 512 : 65536));
+  }
+
+  buddy_get_stats(&stats);
+  for (bucket = 0; bucket < stats.bucket_count; bucket++) {
+    failures += stats.buckets[bucket].failures;
+    growths += stats.buckets[bucket].tree_growths;
+    splits += stats.buckets[bucket].splits;
+    unpreferred += stats.buckets[bucket].unpreferred_splits;
+  }
+  printf("%zu failures, %zu tree growths, %zu kb heap, %zu of %zu splits unpreferred\n",
+    failures, growths, heap_bytes() / 1024, unpreferred, splits);
+  return 0;
+}
@@ -0,0 +1,95 @@
+#!/bin/sh
+#
+# Build each benchmark against the allocator once per configuration it
+# compares and print one line of results per run. Set CC or CFLAGS to
+# override the compiler and its flags.
+#
+
+set -e
+cd "$(dirname "$0")"
+
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2 -std=c99}
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+# Usage: run <BUDDY_MALLOC_CONF> <benchmark> [compiler flags...]
+run() {
+  conf=$1
+  name=$2
+  shift 2
+  $CC $CFLAGS "$@" -o "$OUT/$name" ../buddy-malloc.c "$name.c"
+  label="$*${conf:+ $conf}"
+  printf '%-12s %-52s ' "$name" "${label# }"
+  BUDDY_MALLOC_CONF=$conf "$OUT/$name"
+}
+
+# Usage: run_libc <benchmark> [compiler flags...]
+# Builds the benchmark against the C library's "malloc" for comparison.
+run_libc() {
+  name=$1
+  shift
+  $CC $CFLAGS "$@" -o "$OUT/$name" "$name.c"
+  label="libc $*"
+  printf '%-12s %-52s ' "$name" "${label% }"
+  "$OUT/$name"
+}
+
+run "" engines -DBUDDY_ENGINE=0
+run "" engines -DBUDDY_ENGINE=1
+run "" engines -DBUDDY_ENGINE=2
+run "" engines -DBUDDY_TAGS=16
+run "" engines -DBUDDY_BLOCKED_TREE=1
+run "" engines -DBUDDY_REFILL_LOG2=12
+
+run "placement:0" footprint
+run "placement:1" footprint
+run "placement:2" footprint
+run "" footprint -DBUDDY_LIFETIME_AUTO=1
+
+run "" near -DNEAR=0
+run "" near -DNEAR=1
+
+run "" coloring
+run "" coloring -DBUDDY_CACHE_COLORING=1
+
+run "" copy
+run "" copy -DBUDDY_STREAM_MIN_LOG2=0 -DBUDDY_REMAP_MIN_LOG2=0
+
+run "" find-block
+run "" find-block -DBUDDY_FREE_INDEX=1
+run "" find-block -DBUDDY_ENGINE=1
+run "" find-block -DBUDDY_ENGINE=2
+
+run "" iterate
+run "" iterate -DBUDDY_FREE_INDEX=1
+run "" iterate -DBUDDY_ENGINE=1
+run "" iterate -DBUDDY_ENGINE=2
+
+run "" gc -DBUDDY_GC=1
+run "" gc -DBUDDY_GC=1 -DBUDDY_ENGINE=1
+
+run "" hash32 -DOFFSETS=0
+run "" hash32 -DOFFSETS=1
+
+run "" latency
+run "" latency -DBUDDY_MERGE_STEPS=4
+run "" latency -DBUDDY_FIXED_HEAP_LOG2=28
+run "" latency -DBUDDY_BLOCKED_TREE=1
+run "" latency -DBUDDY_REFILL_LOG2=12
+
+run_libc cache-thrash -pthread
+run "" cache-thrash -DBUDDY_THREADS=1 -pthread
+run_libc cache-scratch -pthread
+run "" cache-scratch -DBUDDY_THREADS=1 -pthread
+
+run "" defer -DDEFERRED=0
+run "" defer -DDEFERRED=1
+run "" defer -DDEFERRED=1 -DBUDDY_THREADS=1 -pthread
+
+run "" preserve -DBUDDY_STATS=1 -DBUDDY_PRESERVE_LARGE=0
+run "" preserve -DBUDDY_STATS=1 -DBUDDY_PRESERVE_LARGE=1
+run "" preserve -DBUDDY_STATS=1 -DBUDDY_PRESERVE_LARGE=0 -DBUDDY_ENGINE=1
+run "" preserve -DBUDDY_STATS=1 -DBUDDY_PRESERVE_LARGE=1 -DBUDDY_ENGINE=1
+run "" preserve -DBUDDY_STATS=1 -DBUDDY_PRESERVE_LARGE=0 -DBUDDY_FIXED_HEAP_LOG2=24
+run "" preserve -DBUDDY_STATS=1 -DBUDDY_PRESERVE_LARGE=1 -DBUDDY_FIXED_HEAP_LOG2=24
@@ -12,24 +12,71 @@
  * for larger allocations again.
  */
 
+/*
+ * "mremap" is a Linux extension and is only declared with _GNU_SOURCE.
+ */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include <memory.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+#include "buddy-malloc.h"
+
+/*
+ * Compiling with "-DBUDDY_STATS=1" keeps counters that can be read with
+ * "buddy_get_stats". Otherwise the counters compile away entirely.
+ */
+#ifndef BUDDY_STATS
+#define BUDDY_STATS 0
+#endif
+
+#if BUDDY_STATS
+#include <time.h>
+#endif
+
 /*
- * Every allocation needs an 8-byte header to store the allocation size while
- * staying 8-byte aligned. The address returned by "malloc" is the address
- * right after this header (i.e. the size occupies the 8 bytes before the
- * returned address).
+ * On 32-bit targets (e.g. "-m32" or WebAssembly), sizes and pointers are only
+ * 4 bytes. Compiling with "-DBUDDY_ILP32=1" on such a target shrinks the
+ * header to 4 bytes and the minimum allocation to 8 bytes, which roughly
+ * halves the footprint of small objects. The catch is that the addresses
+ * returned by "malloc" are then only 4-byte aligned, so this is only
+ * appropriate for code that doesn't need 8-byte alignment.
  */
+#ifndef BUDDY_ILP32
+#define BUDDY_ILP32 0
+#endif
+
+#if BUDDY_ILP32 && (SIZE_MAX != 0xFFFFFFFF || UINTPTR_MAX != 0xFFFFFFFF)
+#error "BUDDY_ILP32 requires a target with 32-bit sizes and pointers"
+#endif
+
+/*
+ * Every allocation needs a header to store the allocation size. The address
+ * returned by "malloc" is the address right after this header (i.e. the size
+ * occupies the bytes before the returned address). The header is 8 bytes by
+ * default to keep returned addresses 8-byte aligned, or 4 bytes (the size of
+ * "size_t") in the 32-bit configuration.
+ */
+#if BUDDY_ILP32
+#define HEADER_SIZE 4
+#else
 #define HEADER_SIZE 8
+#endif
 
 /*
  * The minimum allocation size is 16 bytes because we have an 8-byte header and
- * we need to stay 8-byte aligned.
+ * we need to stay 8-byte aligned. In the 32-bit configuration it's 8 bytes,
+ * which is just enough for a 4-byte header and 4 bytes of data.
  */
+#if BUDDY_ILP32
+#define MIN_ALLOC_LOG2 3
+#else
 #define MIN_ALLOC_LOG2 4
+#endif
 #define MIN_ALLOC ((size_t)1 << MIN_ALLOC_LOG2)
 
 /*
@@ -49,27 +96,775 @@
  *
  * Given a bucket index, the size of the allocations in that bucket can be
  * found with "(size_t)1 << (MAX_ALLOC_LOG2 - bucket)".
+ *
+ * Note that the smaller minimum allocation of the 32-bit configuration adds a
+ * bucket, which makes the tree one level deeper and doubles the size of the
+ * bitmaps below.
  */
 #define BUCKET_COUNT (MAX_ALLOC_LOG2 - MIN_ALLOC_LOG2 + 1)
 
+/*
+ * There are two interchangeable ways of tracking which blocks are free. Both
+ * share the "node_is_split" tree below and only differ in how the set of free
+ * blocks for each bucket is stored:
+ *
+ * - ENGINE_LISTS threads a circular doubly-linked list through the free blocks
+ *   themselves. This needs no extra memory but every push and pop touches the
+ *   (usually cold) memory of a free block.
+ *
+ * - ENGINE_BITMAPS keeps one bit per node in a hierarchical bitmap instead.
+ *   Finding a free block is a few "count trailing zeros" instructions over
+ *   words that are likely to be in the cache, free memory is never written,
+ *   and the block that is found is always the one with the lowest address.
+ *
+ * There is also a third engine that doesn't use "node_is_split" at all:
+ *
+ * - ENGINE_MAX_FREE stores one byte per node with the largest free block in
+ *   the subtree under that node. "malloc" descends from the root to the
+ *   leftmost block that fits and "free" walks back up updating the maxima.
+ *   Free memory is never written, placement is always lowest-address-first,
+ *   and the largest free block is always available at the root.
+ *
+ * The engine is chosen at compile time with "-DBUDDY_ENGINE=...".
+ */
+#define ENGINE_LISTS 0
+#define ENGINE_BITMAPS 1
+#define ENGINE_MAX_FREE 2
+
+#ifndef BUDDY_ENGINE
+#define BUDDY_ENGINE ENGINE_LISTS
+#endif
+
+/*
+ * A free list entry doesn't say which list it's on, so by default
+ * "buddy_find_block", "buddy_iterate" and the collector mark every free list
+ * entry for the duration of the call (see "tag_free_lists"), which costs time
+ * proportional to the number of free blocks. Compiling the list engine with
+ * "-DBUDDY_FREE_INDEX=1" keeps an "is free" bit for every node instead, which
+ * makes those calls independent of the number of free blocks. The bits take
+ * 2^BUCKET_COUNT bits of memory (32mb with the default settings) and every
+ * free list push and pop has to update one.
+ */
+#ifndef BUDDY_FREE_INDEX
+#define BUDDY_FREE_INDEX 0
+#endif
+
+#define FREE_INDEX (BUDDY_FREE_INDEX && BUDDY_ENGINE == ENGINE_LISTS)
+#define FREE_TAGS (!BUDDY_FREE_INDEX && BUDDY_ENGINE == ENGINE_LISTS)
+
+/*
+ * The placement policy decides which block is taken when a bucket has more
+ * than one free block:
+ *
+ * - PLACEMENT_LIFO takes the most recently freed block. This is cheap and
+ *   gives good locality for a "free" followed by a "malloc" of the same size.
+ *
+ * - PLACEMENT_LOWEST takes the free block with the lowest address. Since
+ *   "malloc" already prefers the smallest bucket that fits, this keeps live
+ *   memory packed toward "base_ptr" and leaves the end of the heap free. This
+ *   is what the bitmap engine does naturally. The list engine has to search
+ *   the whole free list for it, which is O(N) in the length of that list.
+ *
+ * - PLACEMENT_TWO_ENDED takes the lowest free block for small requests and
+ *   the highest one for requests of at least 2^BUDDY_PLACEMENT_LARGE_LOG2
+ *   bytes, and splits larger blocks from the same end. Small blocks then
+ *   pack toward "base_ptr" and large blocks toward the end of the tree, so a
+ *   few small blocks don't end up pinning large subtrees that could otherwise
+ *   merge. The tree doesn't grow for this, but the highest block may lie
+ *   past the current break, which moves the break further than lowest-first
+ *   placement would. The max-free engine only takes high blocks from memory
+ *   that was already reserved for that reason. Like PLACEMENT_LOWEST, the
+ *   list engine searches the whole free list.
+ */
+#define PLACEMENT_LIFO 0
+#define PLACEMENT_LOWEST 1
+#define PLACEMENT_TWO_ENDED 2
+
+#ifndef BUDDY_PLACEMENT
+#define BUDDY_PLACEMENT PLACEMENT_LIFO
+#endif
+
+#ifndef BUDDY_PLACEMENT_LARGE_LOG2
+#define BUDDY_PLACEMENT_LARGE_LOG2 16
+#endif
+
+#define LARGE_BUCKET (MAX_ALLOC_LOG2 - config.placement_large_log2)
+
+/*
+ * When no block of the requested size is free, "malloc" splits a block from
+ * the next non-empty larger bucket. Which block gets split matters: a block
+ * whose buddy is partially free can still merge into a larger block once the
+ * rest of its buddy is freed, while a block whose buddy is entirely used is
+ * stuck until that buddy's memory is freed. With "-DBUDDY_PRESERVE_LARGE=1",
+ * "malloc" looks at up to SPLIT_CANDIDATES blocks and splits one whose buddy
+ * is entirely used if it finds one, which leaves the blocks that are more
+ * likely to become large free blocks intact.
+ *
+ * This only affects the list engine with PLACEMENT_LIFO and the bitmap
+ * engine without PLACEMENT_TWO_ENDED. Lowest-first placement with free lists
+ * always takes the lowest block, two-ended placement always takes a block
+ * from its end, and the max-free engine always takes the leftmost block.
+ */
+#ifndef BUDDY_PRESERVE_LARGE
+#define BUDDY_PRESERVE_LARGE 0
+#endif
+
+#define SPLIT_CANDIDATES 8
+
+/*
+ * Splitting a large block down to a small size takes one step per level and
+ * only produces one free block per level. A burst of small allocations then
+ * keeps walking back up to larger buckets. With "-DBUDDY_REFILL_LOG2=12", a
+ * request for a block that's at most 1/8th of 4kb that finds its own bucket
+ * empty (and no smaller-than-4kb blocks to split either) splits a whole 4kb
+ * block directly into blocks of the requested size instead. All but one of
+ * them are added to the free list in a single pass.
+ *
+ * Blocks carved this way have free buddies, so they don't merge back into
+ * the original block until the blocks next to them have been allocated and
+ * freed again. The state of the tree is still consistent: the carved block
+ * and all of its internal nodes count as USED, which means all of their
+ * "is split" bits are zero (which they already are in a free block).
+ */
+#ifndef BUDDY_REFILL_LOG2
+#define BUDDY_REFILL_LOG2 0
+#endif
+
+#define REFILL_BUCKET (MAX_ALLOC_LOG2 - BUDDY_REFILL_LOG2)
+#define REFILL_MIN_BLOCKS_LOG2 3
+
+/*
+ * With "-DBUDDY_FIXED_HEAP_LOG2=24", the heap is a fixed 2^24 bytes that is
+ * reserved, faulted in and locked into memory (if "mlock" is allowed) when
+ * the program starts. The tree starts out at that size and never grows, so
+ * "malloc" and "free" never make a system call, and requests that don't fit
+ * fail instead. Each call then takes bounded time:
+ *
+ *   - "malloc" looks at the free blocks of at most BUCKET_COUNT buckets and
+ *     does at most BUCKET_COUNT splits. A request that no free block fits
+ *     first finishes any parked merges and frees any deferred blocks, so it
+ *     doesn't fail while that memory could still be used.
+ *   - "free" does at most BUCKET_COUNT merges (or 2 * BUDDY_MERGE_STEPS).
+ *
+ * Finding a free block is O(1) per bucket except with "-DBUDDY_PLACEMENT=1"
+ * and the free list engine, which searches the list. "realloc" always copies
+ * in this mode instead of moving pages with "mremap". In thread-safe mode,
+ * the lock can still enter the kernel when threads contend for it, and the
+ * first "free_deferred" starts a background thread that the later ones wake
+ * through a condition variable. Those are system calls too. The default of 0
+ * grows the heap with "brk" as needed.
+ */
+#ifndef BUDDY_FIXED_HEAP_LOG2
+#define BUDDY_FIXED_HEAP_LOG2 0
+#endif
+
+#if BUDDY_FIXED_HEAP_LOG2
+#if BUDDY_FIXED_HEAP_LOG2 > MAX_ALLOC_LOG2 || BUDDY_FIXED_HEAP_LOG2 < MIN_ALLOC_LOG2
+#error "BUDDY_FIXED_HEAP_LOG2 must be between MIN_ALLOC_LOG2 and MAX_ALLOC_LOG2"
+#endif
+#include <sys/mman.h>
+#define FIXED_HEAP_SIZE ((size_t)1 << BUDDY_FIXED_HEAP_LOG2)
+#define FIXED_BUCKET (MAX_ALLOC_LOG2 - BUDDY_FIXED_HEAP_LOG2)
+#define FIXED_PAGE_SIZE 4096
+#endif
+
+/*
+ * Freeing a block merges it with its buddy, then merges the result with its
+ * buddy, and so on. That can take up to BUCKET_COUNT steps that each touch a
+ * cold free list entry. With "-DBUDDY_MERGE_STEPS=4", a block stops merging
+ * after that many steps and is parked in its current bucket. Later calls to
+ * "malloc" and "free", and "buddy_tick", each do up to that many more merge
+ * steps on parked blocks. So no call does more than twice that many, except
+ * a "malloc" that no free block is large enough for. That one finishes all
+ * parked merges first, since it would have to grow the heap otherwise.
+ *
+ * A parked block is free and its buddy is free too, like a block carved by a
+ * refill. The free list engine keeps parked blocks on separate lists that
+ * allocation doesn't look at, so they can be taken back off. The bitmap
+ * engine leaves them where allocation can find them and remembers up to
+ * PARK_SIZE of them. A parked block that was allocated in the meantime is
+ * skipped, and any that don't fit are left unmerged until they're reused.
+ * The default of 0 always merges as far as possible.
+ */
+#ifndef BUDDY_MERGE_STEPS
+#define BUDDY_MERGE_STEPS 0
+#endif
+
+#if BUDDY_MERGE_STEPS
+#if BUDDY_ENGINE == ENGINE_MAX_FREE
+#error "BUDDY_MERGE_STEPS needs an engine with split bits"
+#endif
+#define PARK_SIZE 1024
+#endif
+
+/*
+ * Moving the program break with "brk" is a system call, so the heap is grown
+ * in chunks instead of by exactly as much as is needed. The chunk size is an
+ * eighth of the current size of the heap (so the heap grows geometrically),
+ * but at least 2^BUDDY_GROWTH_MIN_LOG2 bytes (a page) and at most
+ * 2^BUDDY_GROWTH_MAX_LOG2 bytes. Setting BUDDY_GROWTH_MAX_LOG2 to 0 grows the
+ * heap by exactly as much as is needed.
+ */
+#ifndef BUDDY_GROWTH_MIN_LOG2
+#define BUDDY_GROWTH_MIN_LOG2 12
+#endif
+
+#ifndef BUDDY_GROWTH_MAX_LOG2
+#define BUDDY_GROWTH_MAX_LOG2 22
+#endif
+
+#define GROWTH_RATIO_LOG2 3
+
+/*
+ * Every block of 4kb or more starts at an address that's a multiple of its
+ * size, so equally-sized buffers all map to the same cache sets and evict
+ * each other when they're used at the same time. With
+ * "-DBUDDY_CACHE_COLORING=1", allocations in blocks of at least
+ * 2^COLOR_MIN_LOG2 bytes are shifted forward inside their block by a whole
+ * number of cache lines, if the block has room to spare. The shift ("color")
+ * rotates with the position of the block so neighboring blocks of the same
+ * size get different colors.
+ *
+ * The size is also written at the start of the block, so the start of the
+ * block always has a header. "free" recovers the start of the block from the
+ * returned address by rounding down to the block size. The color can always
+ * be computed again from the size at the start of the block.
+ */
+#ifndef BUDDY_CACHE_COLORING
+#define BUDDY_CACHE_COLORING 0
+#endif
+
+#define COLOR_MIN_LOG2 12
+#define COLOR_COUNT 64
+#define CACHE_LINE_LOG2 6
+#define CACHE_LINE_SIZE ((size_t)1 << CACHE_LINE_LOG2)
+
+/*
+ * The start of the heap is rounded up to this alignment so that blocks are
+ * aligned to their size (up to this size) in absolute terms, not just
+ * relative to "base_ptr". This is what makes cache lines and pages line up
+ * with blocks.
+ */
+#define BASE_ALIGNMENT 4096
+
+/*
+ * "malloc_near" only looks for free blocks within the enclosing block of this
+ * size around the hint. Beyond that there's no locality to be gained, so it
+ * falls back to a normal "malloc". The default of 2mb is the size of a large
+ * page on x86-64.
+ */
+#ifndef BUDDY_NEAR_WINDOW_LOG2
+#define BUDDY_NEAR_WINDOW_LOG2 21
+#endif
+
+/*
+ * "malloc_lifetime" keeps blocks with different expected lifetimes apart.
+ * Each lifetime class remembers its most recent block and new blocks of that
+ * class are placed near it with the same search as "malloc_near", but only
+ * within the aligned region of 2^BUDDY_LIFETIME_REGION_LOG2 bytes that holds
+ * it. When there's no room there, the block goes wherever "malloc" would put
+ * it, unless that's in a region that holds blocks of the other class. Then
+ * it starts a new region that's entirely free instead, taken from the low
+ * end of the heap for long-lived blocks and from the high end for
+ * short-lived ones. The classes live in disjoint subtrees this way, so
+ * long-lived blocks don't end up scattered among short-lived ones, where
+ * each would stop its neighborhood from merging. Only when no region is
+ * entirely free do they share one.
+ *
+ * The lifetime of a call site can also be learned. One in every
+ * 2^BUDDY_LIFETIME_SAMPLE_LOG2 allocations with an unknown lifetime is
+ * sampled along with its return address, and when it's freed the site gets
+ * a vote for whichever class it belongs to. A block is long-lived if at
+ * least 2^BUDDY_LIFETIME_LONG_LOG2 more such allocations happened before it
+ * was freed. With "-DBUDDY_LIFETIME_AUTO=1", every "malloc" is placed using
+ * what was learned about its caller.
+ */
+#ifndef BUDDY_LIFETIME_AUTO
+#define BUDDY_LIFETIME_AUTO 0
+#endif
+
+#ifndef BUDDY_LIFETIME_SAMPLE_LOG2
+#define BUDDY_LIFETIME_SAMPLE_LOG2 6
+#endif
+
+#ifndef BUDDY_LIFETIME_LONG_LOG2
+#define BUDDY_LIFETIME_LONG_LOG2 16
+#endif
+
+#ifndef BUDDY_LIFETIME_REGION_LOG2
+#define BUDDY_LIFETIME_REGION_LOG2 16
+#endif
+
+#if BUDDY_LIFETIME_REGION_LOG2 > MAX_ALLOC_LOG2 || BUDDY_LIFETIME_REGION_LOG2 < MIN_ALLOC_LOG2
+#error "BUDDY_LIFETIME_REGION_LOG2 must be between MIN_ALLOC_LOG2 and MAX_ALLOC_LOG2"
+#endif
+
+#define REGION_BUCKET (MAX_ALLOC_LOG2 - BUDDY_LIFETIME_REGION_LOG2)
+
+#define LIFETIME_SITES 256
+#define LIFETIME_SAMPLES 64
+#define LIFETIME_SCORE_MAX 4
+
+/*
+ * With "-DBUDDY_TAGS=16", every allocation is charged to one of 16 tags (a
+ * tenant or a subsystem, say) and the allocator keeps the number of bytes in
+ * use per tag. Allocations use the calling thread's tag unless they come from
+ * "malloc_tagged". Each tag can have a soft quota, which calls a callback when
+ * it's crossed, and a hard quota, past which allocations for that tag fail.
+ * Usage counts whole blocks since that's what a tag takes from the heap.
+ *
+ * The tag is stored in the header above the requested size, which is always
+ * less than 2^31, so this needs 64-bit headers. The default of 0 disables
+ * tags.
+ */
+#ifndef BUDDY_TAGS
+#define BUDDY_TAGS 0
+#endif
+
+#if BUDDY_TAGS
+#if BUDDY_ILP32
+#error "BUDDY_TAGS needs 64-bit headers"
+#endif
+#if BUDDY_TAGS > 256
+#error "BUDDY_TAGS must be at most 256"
+#endif
+#define TAG_SHIFT 32
+#define TAG_MASK ((size_t)0xFF << TAG_SHIFT)
+#else
+#define TAG_MASK 0
+#endif
+
+/*
+ * The part of a header that isn't the tag.
+ */
+#define HEADER_REQUEST(header) ((header) & ~(size_t)TAG_MASK)
+
+/*
+ * With "-DBUDDY_RSS_LIMITS=1", the allocator keeps an estimate of how much of
+ * the heap is resident and reacts to the limits set by "buddy_set_rss_limits"
+ * (Linux only). The estimate grows by the size of every block handed out and
+ * drops to the bytes in live blocks after a purge, which releases the whole
+ * pages inside free blocks with "madvise" and lowers the break if the end of
+ * the heap is free. Reusing a block that's still resident counts it again,
+ * so before purging, the estimate is also capped by the RSS of the whole
+ * process from "/proc/self/statm". Deferred frees and parked merges are
+ * finished first so that free blocks are as large as possible.
+ *
+ *   - Past the soft limit, "malloc" purges once at least 1/16th of the limit
+ *     may be free memory that's still resident.
+ *   - At the hard limit, "malloc" purges, and fails if that isn't enough.
+ *     "malloc" and "calloc" then call the pressure callback outside of the
+ *     lock and try once more before returning NULL.
+ *
+ * With "-DBUDDY_CGROUP_POLL_LOG2=10", every 2^10 allocations also look at the
+ * cgroup v2 files of the process ("/sys/fs/cgroup/memory.*" as seen from a
+ * container) and purge if "memory.events" reports new "high" or "max" events
+ * or "memory.current" is within 1/8th of "memory.max".
+ */
+#ifndef BUDDY_RSS_LIMITS
+#define BUDDY_RSS_LIMITS 0
+#endif
+
+#ifndef BUDDY_CGROUP_POLL_LOG2
+#define BUDDY_CGROUP_POLL_LOG2 0
+#endif
+
+#if BUDDY_RSS_LIMITS
+#if BUDDY_FIXED_HEAP_LOG2
+#error "BUDDY_RSS_LIMITS doesn't work with a fixed heap"
+#endif
+#include <fcntl.h>
+#include <sys/mman.h>
+#define PURGE_PAGE_SIZE 4096
+#define PURGE_BUCKET (MAX_ALLOC_LOG2 - 12)
+#endif
+
+#if BUDDY_CGROUP_POLL_LOG2 && !BUDDY_RSS_LIMITS
+#error "BUDDY_CGROUP_POLL_LOG2 needs BUDDY_RSS_LIMITS"
+#endif
+
+/*
+ * Compiling with "-DBUDDY_THREADS=1" makes the allocator safe to call from
+ * multiple threads (link with "-pthread"). Every call takes a single global
+ * lock, so this is about correctness rather than scalability.
+ *
+ * It also guarantees that blocks handed to different threads never share a
+ * cache line, so threads writing to their own small objects don't bounce the
+ * line between cores. The free lists for blocks smaller than a cache line
+ * are kept per thread. A cache-line block that gets split for one thread
+ * only feeds that thread's lists, and freeing a small block puts it back on
+ * the lists of the thread that allocated it, whichever thread calls "free".
+ * Once a whole line is free again it merges back into the shared tree, so
+ * memory moves between threads one cache line at a time.
+ *
+ * The per-thread lists live in a table of BUDDY_MAX_THREADS slots and the
+ * slot is stored in the header of small blocks. When a thread exits, its
+ * slot (including any partially-used lines) is passed on to the next thread
+ * that allocates. Threads that find the table full get a whole cache line
+ * for each small request instead, so they still never share a line, and
+ * their deferred frees are freed right away. This mode needs the free list
+ * engine.
+ *
+ * A "fork" waits for any call in progress in another thread and the child
+ * starts with only the forking thread's slot in use.
+ */
+#ifndef BUDDY_THREADS
+#define BUDDY_THREADS 0
+#endif
+
+#ifndef BUDDY_MAX_THREADS
+#define BUDDY_MAX_THREADS 64
+#endif
+
+#if BUDDY_THREADS
+#include <pthread.h>
+#include <time.h>
+
+#if BUDDY_ENGINE != ENGINE_LISTS
+#error "BUDDY_THREADS requires the free list engine"
+#endif
+
+/*
+ * LINE_BUCKET is the bucket of cache-line-sized blocks. The headers of
+ * blocks in smaller buckets have OWNER_FLAG set and the owning slot stored
+ * above the size (which is always less than a cache line for those blocks).
+ * A slot of NO_OWNER means a small request that was given a whole line.
+ */
+#define LINE_BUCKET (MAX_ALLOC_LOG2 - CACHE_LINE_LOG2)
+#define OWNER_FLAG ((size_t)1 << (sizeof(size_t) * 8 - 1))
+#define NO_OWNER BUDDY_MAX_THREADS
+
+#define LOCK() pthread_mutex_lock(&lock)
+#define UNLOCK() pthread_mutex_unlock(&lock)
+#else
+#define LOCK() ((void)0)
+#define UNLOCK() ((void)0)
+#endif
+
+/*
+ * "free_deferred" queues blocks in a buffer of 2^BUDDY_DEFER_LOG2 pointers
+ * instead of freeing them right away. A batch is freed at once, sorted by
+ * address so that neighboring buddies are freed one after the other. In
+ * thread-safe mode every thread with a slot has its own buffer, which only
+ * that thread writes to, and a background thread empties the buffers. Without
+ * threads the buffer is emptied when it fills up. Either way, a thread whose
+ * buffer is full frees the batch itself, and an allocation that fails frees
+ * all queued blocks and tries again.
+ */
+#ifndef BUDDY_DEFER_LOG2
+#define BUDDY_DEFER_LOG2 8
+#endif
+
+#define DEFER_SIZE ((size_t)1 << BUDDY_DEFER_LOG2)
+
+#if BUDDY_THREADS
+/*
+ * The background thread wakes up at least this often, and sooner when a
+ * buffer is half full.
+ */
+#define RECLAIM_INTERVAL_NS 10000000
+#define LOAD_ACQUIRE(value) __atomic_load_n(&(value), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(value, new_value) __atomic_store_n(&(value), new_value, __ATOMIC_RELEASE)
+#else
+#define LOAD_ACQUIRE(value) (value)
+#define STORE_RELEASE(value, new_value) ((value) = (new_value))
+#endif
+
+/*
+ * When "realloc" moves a block or "calloc" clears one, copies and clears of
+ * at least 2^BUDDY_STREAM_MIN_LOG2 bytes use non-temporal stores on x86-64.
+ * These write around the cache, so a large copy doesn't evict the working
+ * set for data that won't be read again soon. The widest kernel the CPU
+ * supports is picked at runtime (AVX2, or SSE2 which every x86-64 CPU has).
+ * Set this to 0 to always use "memcpy" and "memset". Otherwise it must be at
+ * least 7, so that a streamed range always covers a whole cache line.
+ */
+#ifndef BUDDY_STREAM_MIN_LOG2
+#define BUDDY_STREAM_MIN_LOG2 20
+#endif
+
+#if BUDDY_STREAM_MIN_LOG2 && BUDDY_STREAM_MIN_LOG2 < 7
+#error "BUDDY_STREAM_MIN_LOG2 must be 0 or at least 7"
+#endif
+
+#if BUDDY_STREAM_MIN_LOG2 && defined(__GNUC__) && defined(__x86_64__)
+#define STREAM_KERNELS 1
+#include <immintrin.h>
+#else
+#define STREAM_KERNELS 0
+#endif
+
+/*
+ * On Linux, "realloc" moves blocks of at least 2^BUDDY_REMAP_MIN_LOG2 bytes
+ * by moving their pages with "mremap" instead of copying them. This is only
+ * possible when both blocks are page-aligned and at least a page long, and
+ * the payload starts at the same offset in both of them. The old pages are
+ * left behind as fresh zero pages. A fixed heap never does this, since it
+ * must not make system calls or leave pages that aren't faulted in. Set this
+ * to 0 to always copy. Otherwise it must be at least 12, the log2 of the
+ * page size.
+ */
+#ifndef BUDDY_REMAP_MIN_LOG2
+#define BUDDY_REMAP_MIN_LOG2 20
+#endif
+
+#if BUDDY_REMAP_MIN_LOG2 && BUDDY_REMAP_MIN_LOG2 < 12
+#error "BUDDY_REMAP_MIN_LOG2 must be 0 or at least 12"
+#endif
+
+#if BUDDY_REMAP_MIN_LOG2 && defined(__linux__) && !BUDDY_FIXED_HEAP_LOG2
+#define REMAP_BLOCKS 1
+#include <sys/mman.h>
+#ifndef MREMAP_DONTUNMAP
+#define MREMAP_DONTUNMAP 4
+#endif
+#define REMAP_PAGE_LOG2 12
+#define REMAP_PAGE_SIZE ((size_t)1 << REMAP_PAGE_LOG2)
+#else
+#define REMAP_BLOCKS 0
+#endif
+
+/*
+ * Compiling with "-DBUDDY_GC=1" adds a conservative mark-sweep collector for
+ * blocks allocated with "buddy_gc_malloc". A collection marks every such
+ * block that can be reached from the roots and frees the rest. The roots are
+ * the calling thread's stack and registers, the program's data and bss
+ * segments, and every live block that isn't collectable. Any word that points
+ * into a block keeps it alive, so nothing needs to know the layout of the
+ * data. This finds the roots the way glibc lays them out, and other threads'
+ * stacks aren't scanned, so it's limited to single-threaded Linux programs.
+ */
+#ifndef BUDDY_GC
+#define BUDDY_GC 0
+#endif
+
+#if BUDDY_GC
+#if BUDDY_THREADS || !defined(__GLIBC__)
+#error "BUDDY_GC only works in single-threaded programs using glibc"
+#endif
+#include <setjmp.h>
+#define GC_BITMAP_WORDS ((MAX_ALLOC >> MIN_ALLOC_LOG2) / 64)
+#define GC_STACK_SIZE 4096
+#endif
+
+/*
+ * Transparent huge pages can be requested ("thp:1") or ruled out ("thp:2")
+ * for the heap as it grows. The default of 0 leaves it to the system.
+ */
+#ifndef BUDDY_THP
+#define BUDDY_THP 0
+#endif
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#define THP_ADVICE 1
+#else
+#define THP_ADVICE 0
+#endif
+
+/*
+ * Many of the options above can also be changed without rebuilding, either
+ * with the "BUDDY_MALLOC_CONF" environment variable (a list like
+ * "placement:2,growth_max_log2:24,rss_soft_limit:512m") or with "buddy_ctl".
+ * The compile-time values are the defaults, the variable is read once when
+ * the allocator starts, and unknown or out-of-range entries are ignored.
+ * The fields of "config" are only written with the lock held, and most
+ * readers hold it too. "realloc" and "calloc" copy and clear outside of the
+ * lock, so the thresholds for that are read with LOAD_ACQUIRE instead.
+ * Options for features that weren't compiled in don't exist.
+ */
+static struct {
+  size_t placement;
+  size_t placement_large_log2;
+  size_t growth_min_log2;
+  size_t growth_max_log2;
+  size_t near_window_log2;
+#if BUDDY_MERGE_STEPS
+  size_t merge_steps;
+#endif
+#if STREAM_KERNELS
+  size_t stream_min_log2;
+#endif
+#if REMAP_BLOCKS
+  size_t remap_min_log2;
+#endif
+#if BUDDY_RSS_LIMITS
+  size_t rss_soft_limit;
+  size_t rss_hard_limit;
+#endif
+#if THP_ADVICE
+  size_t thp;
+#endif
+#if BUDDY_STATS
+  size_t stats;
+#endif
+} config = {
+  BUDDY_PLACEMENT,
+  BUDDY_PLACEMENT_LARGE_LOG2,
+  BUDDY_GROWTH_MIN_LOG2,
+  BUDDY_GROWTH_MAX_LOG2,
+  BUDDY_NEAR_WINDOW_LOG2,
+#if BUDDY_MERGE_STEPS
+  BUDDY_MERGE_STEPS,
+#endif
+#if STREAM_KERNELS
+  BUDDY_STREAM_MIN_LOG2,
+#endif
+#if REMAP_BLOCKS
+  BUDDY_REMAP_MIN_LOG2,
+#endif
+#if BUDDY_RSS_LIMITS
+  0,
+  0,
+#endif
+#if THP_ADVICE
+  BUDDY_THP,
+#endif
+#if BUDDY_STATS
+  1,
+#endif
+};
+
+/*
+ * The name of each option and the range of values it accepts.
+ */
+typedef struct {
+  const char *name;
+  size_t *value;
+  size_t min;
+  size_t max;
+} option_t;
+
+static const option_t options[] = {
+  { "placement", &config.placement, PLACEMENT_LIFO, PLACEMENT_TWO_ENDED },
+  { "placement_large_log2", &config.placement_large_log2, MIN_ALLOC_LOG2, MAX_ALLOC_LOG2 },
+  { "growth_min_log2", &config.growth_min_log2, 0, MAX_ALLOC_LOG2 },
+  { "growth_max_log2", &config.growth_max_log2, 0, MAX_ALLOC_LOG2 },
+  { "near_window_log2", &config.near_window_log2, 0, MAX_ALLOC_LOG2 },
+#if BUDDY_MERGE_STEPS
+  { "merge_steps", &config.merge_steps, 1, SIZE_MAX },
+#endif
+#if STREAM_KERNELS
+  { "stream_min_log2", &config.stream_min_log2, 7, MAX_ALLOC_LOG2 },
+#endif
+#if REMAP_BLOCKS
+  { "remap_min_log2", &config.remap_min_log2, REMAP_PAGE_LOG2, MAX_ALLOC_LOG2 },
+#endif
+#if BUDDY_RSS_LIMITS
+  { "rss_soft_limit", &config.rss_soft_limit, 0, SIZE_MAX },
+  { "rss_hard_limit", &config.rss_hard_limit, 0, SIZE_MAX },
+#endif
+#if THP_ADVICE
+  { "thp", &config.thp, 0, 2 },
+#endif
+#if BUDDY_STATS
+  { "stats", &config.stats, 0, 1 },
+#endif
+};
+
+#if BUDDY_STATS
+static struct buddy_stats stats;
+#define STAT(expression) ((void)(config.stats && (expression)))
+#else
+#define STAT(expression) ((void)0)
+#endif
+
 /*
  * Free lists are stored as circular doubly-linked lists. Every possible
  * allocation size has an associated free list that is threaded through all
  * currently free blocks of that size. That means MIN_ALLOC must be at least
- * "sizeof(list_t)". MIN_ALLOC is currently 16 bytes, so this will be true for
- * both 32-bit and 64-bit.
+ * "sizeof(list_t)". MIN_ALLOC is 16 bytes by default, so this will be true for
+ * both 32-bit and 64-bit. In the 32-bit configuration it's 8 bytes, which is
+ * exactly "sizeof(list_t)" when pointers are 4 bytes.
  */
 typedef struct list_t {
   struct list_t *prev, *next;
 } list_t;
 
+/*
+ * This is the number of bytes at the start of a free block that the free
+ * block tracking writes to. That memory must be reserved before a block is
+ * added to a free list.
+ */
+#if BUDDY_ENGINE == ENGINE_LISTS
+#define FREE_ENTRY_SIZE sizeof(list_t)
+#else
+#define FREE_ENTRY_SIZE 0
+#endif
+
 /*
  * Each bucket corresponds to a certain allocation size and stores a free list
  * for that size. The bucket at index 0 corresponds to an allocation size of
  * MAX_ALLOC (i.e. the whole address space).
  */
+#if BUDDY_ENGINE == ENGINE_LISTS
 static list_t buckets[BUCKET_COUNT];
+#endif
+
+#if BUDDY_MERGE_STEPS
+/*
+ * These hold the parked blocks. With free lists there's a list per bucket,
+ * and "parked_buckets" has a bit set for each list that may be non-empty
+ * (merging takes blocks off these lists without clearing the bit). With the
+ * bitmap there's a stack of parked nodes.
+ */
+#if BUDDY_ENGINE == ENGINE_LISTS
+static list_t parked[BUCKET_COUNT];
+static uint32_t parked_buckets;
+#else
+static struct {
+  size_t index;
+  size_t bucket;
+} parked[PARK_SIZE];
+static size_t parked_count;
+#endif
+#endif
+
+/*
+ * A buffer of blocks queued by "free_deferred". Only one thread adds to it
+ * and advances "head". Blocks are only taken out with the lock held, which
+ * advances "tail". Both only ever increase, so "head - tail" is the number
+ * of queued blocks.
+ */
+typedef struct {
+  void *ptrs[DEFER_SIZE];
+  size_t head;
+  size_t tail;
+} defer_ring_t;
+
+#if BUDDY_THREADS
+/*
+ * Each slot holds the free lists of one thread for the buckets below
+ * LINE_BUCKET and that thread's deferred frees. The extra slot at NO_OWNER
+ * is never used for blocks and stands for "no slot available".
+ * "current_cache" is the slot whose lists the current call uses, which is
+ * the caller's slot for "malloc" and the block owner's slot for "free".
+ */
+typedef struct thread_cache_t {
+  list_t buckets[BUCKET_COUNT - LINE_BUCKET - 1];
+  int in_use;
+  defer_ring_t deferred;
+} thread_cache_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+static int thread_key_ready;
+static thread_cache_t thread_caches[BUDDY_MAX_THREADS + 1];
+static thread_cache_t *current_cache;
+static pthread_once_t reclaimer_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t reclaimer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaimer_wake = PTHREAD_COND_INITIALIZER;
+#else
+static defer_ring_t deferred;
+#endif
+
+/*
+ * Blocks taken out of a deferred buffer are sorted here before being freed.
+ */
+static void *defer_batch[DEFER_SIZE];
 
+#if BUDDY_ENGINE != ENGINE_MAX_FREE
 /*
  * We could initialize the allocator by giving it one free block the size of
  * the entire address space. However, this would cause us to instantly reserve
@@ -107,7 +902,111 @@ static size_t bucket_limit;
  * Note that we don't need to store any nodes for allocations of size MIN_ALLOC
  * since we only ever care about parent nodes.
  */
+#ifndef BUDDY_BLOCKED_TREE
+#define BUDDY_BLOCKED_TREE 0
+#endif
+
+#if BUDDY_BLOCKED_TREE
+/*
+ * In the linearized layout above, a node and its parent are exponentially far
+ * apart in memory, so every step of the loops in "malloc" and "free" touches
+ * a different cache line. Compiling with "-DBUDDY_BLOCKED_TREE=1" stores the
+ * same bits in a blocked layout instead. The tree is cut into bands that are
+ * SPLIT_BLOCK_LEVELS levels tall, and each subtree within a band is stored in
+ * breadth-first order in its own 64-byte block. A subtree of 9 levels has 511
+ * nodes, which fits in the 512 bits of a cache line, so a walk from a node to
+ * the root only touches one cache line per band.
+ *
+ * Node indices are still the breadth-first indices described above, so the
+ * parent, child, and sibling arithmetic and "ptr_for_node"/"node_for_ptr" are
+ * unchanged. Only the mapping from a node index to its bit is different (see
+ * "split_bit_for_node"). If the number of levels isn't a multiple of the band
+ * height, the bottom band is shorter and its subtrees are packed tighter.
+ */
+#define SPLIT_BLOCK_LEVELS 9
+#define SPLIT_TREE_LEVELS (BUCKET_COUNT - 1)
+#define SPLIT_FULL_BANDS (SPLIT_TREE_LEVELS / SPLIT_BLOCK_LEVELS)
+#define SPLIT_LAST_LEVELS (SPLIT_TREE_LEVELS % SPLIT_BLOCK_LEVELS)
+#define SPLIT_BAND_OFFSET(band) \
+  (((((size_t)1 << (SPLIT_BLOCK_LEVELS * (band))) - 1) / \
+    ((1 << SPLIT_BLOCK_LEVELS) - 1)) << SPLIT_BLOCK_LEVELS)
+#define SPLIT_BITS (SPLIT_BAND_OFFSET(SPLIT_FULL_BANDS) + (SPLIT_LAST_LEVELS ? \
+  (size_t)1 << (SPLIT_BLOCK_LEVELS * SPLIT_FULL_BANDS + SPLIT_LAST_LEVELS) : 0))
+
+#if defined(__GNUC__)
+static uint8_t node_is_split[SPLIT_BITS / 8] __attribute__((aligned(64)));
+#else
+static uint8_t node_is_split[SPLIT_BITS / 8];
+#endif
+#else
 static uint8_t node_is_split[(1 << (BUCKET_COUNT - 1)) / 8];
+#endif
+
+#if FREE_INDEX
+/*
+ * The "is free" bit of every node for "-DBUDDY_FREE_INDEX=1". Only
+ * "buddy_find_block", "buddy_iterate" and the collector read it, to tell a
+ * free block at the start of a node from a used one.
+ */
+static uint64_t node_is_free_bits[((size_t)1 << BUCKET_COUNT) / 64];
+#endif
+#else
+/*
+ * The max-free engine stores a byte for every node in the tree, including the
+ * nodes of size MIN_ALLOC, using the same linearized layout as above. The
+ * byte holds the size of the largest free block in the subtree rooted at that
+ * node, stored as "BUCKET_COUNT - bucket" so that a free MIN_ALLOC block is 1
+ * and no free space at all is 0. A node is entirely free when its byte has
+ * the largest value possible for its bucket.
+ *
+ * The bytes under an entirely free node are never read, which means they only
+ * need to be written when that node is split. So only the root needs to be
+ * initialized and only the parts of this array that cover the used part of
+ * the heap are ever touched, even though the array itself is large (about
+ * 256mb of zero-initialized memory with the default settings).
+ *
+ * Because the tree doesn't write to free memory, it covers the whole address
+ * range from the start and doesn't need to grow like the other engines.
+ */
+#if BUDDY_ILP32
+#error "The max-free engine needs more memory than a 32-bit address space has"
+#endif
+static uint8_t node_max_free[((size_t)1 << BUCKET_COUNT) - 1];
+#endif
+
+#if BUDDY_ENGINE == ENGINE_BITMAPS
+/*
+ * The bitmap engine stores a "is free" bit for every node in the tree,
+ * including nodes of size MIN_ALLOC. The bit for node "index" lives at bit
+ * "index + 1" so that the nodes for bucket "b" occupy the bit range from
+ * "1 << b" to "2 << b". For all but the smallest buckets, that range starts
+ * and ends on a 64-bit word boundary so no word is shared between buckets.
+ *
+ * Scanning the whole range for a large bucket would be slow, so each level of
+ * the bitmap has a summary level above it with one bit per word of the level
+ * below that is set when that word is non-zero. Levels are added until the
+ * top level fits in a single word. With the default settings this is five
+ * levels and the whole structure is about 32mb of zero-initialized memory,
+ * although only the parts covering the used part of the heap are touched.
+ */
+#define FREE_BITMAP_LEVELS ((BUCKET_COUNT + 5) / 6)
+#define FREE_BITMAP_WORDS (((size_t)1 << BUCKET_COUNT) / 63 + FREE_BITMAP_LEVELS)
+static uint64_t free_bitmap[FREE_BITMAP_WORDS];
+
+/*
+ * The offset of the first word of each level in "free_bitmap". Level 0 is the
+ * bottom level with one bit per node. This is filled in on the first call to
+ * "malloc".
+ */
+static size_t free_bitmap_level[FREE_BITMAP_LEVELS];
+
+/*
+ * The bitmap has no notion of order, so LIFO placement is approximated by
+ * remembering the bit for the last block added to each bucket. It's used if
+ * it's still free and the lowest free block is used otherwise.
+ */
+static size_t free_bitmap_last[BUCKET_COUNT];
+#endif
 
 /*
  * This is the starting address of the address range for this allocator. Every
@@ -115,12 +1014,93 @@ static uint8_t node_is_split[(1 << (BUCKET_COUNT - 1)) / 8];
  */
 static uint8_t *base_ptr;
 
+/*
+ * This is a copy of "base_ptr" that the inline offset conversions in the
+ * header can see. It's only written once, when the heap is first set up.
+ */
+char *buddy_heap_base;
+
 /*
  * This is the maximum address that has ever been used by the allocator. It's
  * used to know when to call "brk" to request more memory from the kernel.
  */
 static uint8_t *max_ptr;
 
+#if BUDDY_GC
+/*
+ * The collector keeps two bitmaps with one bit per MIN_ALLOC bytes of the
+ * address range, indexed by the start of a block. "gc_blocks" marks the used
+ * blocks that are collectable and "gc_marks" the ones that have been found
+ * to be reachable. Only the parts covering the heap so far are touched.
+ *
+ * Marking is done with an explicit stack of blocks whose contents still need
+ * to be scanned. When it overflows, "gc_stack_overflow" is set and marked
+ * blocks are scanned again until nothing new is found.
+ */
+static uint64_t gc_blocks[GC_BITMAP_WORDS];
+static uint64_t gc_marks[GC_BITMAP_WORDS];
+static uint8_t *gc_stack[GC_STACK_SIZE];
+static size_t gc_stack_top;
+static int gc_stack_overflow;
+
+/*
+ * These are provided by the linker and by glibc.
+ */
+extern char __data_start[], _end[];
+extern void *__libc_stack_end;
+
+static size_t gc_bit_for_block(uint8_t *ptr) {
+  return (size_t)(ptr - base_ptr) >> MIN_ALLOC_LOG2;
+}
+
+static int gc_test(const uint64_t *bits, size_t bit) {
+  return (bits[bit / 64] >> (bit % 64)) & 1;
+}
+
+static void gc_set(uint64_t *bits, size_t bit) {
+  bits[bit / 64] |= (uint64_t)1 << (bit % 64);
+}
+
+static void gc_clear(uint64_t *bits, size_t bit) {
+  bits[bit / 64] &= ~((uint64_t)1 << (bit % 64));
+}
+#endif
+
+/*
+ * Move the program break to "new_value". This returns false if that failed.
+ * When statistics are enabled, the number of calls and the time spent in the
+ * system call are recorded too.
+ */
+static int move_break(uint8_t *new_value) {
+  int result;
+#if BUDDY_STATS
+  struct timespec before, after;
+
+  if (config.stats) {
+    clock_gettime(CLOCK_MONOTONIC, &before);
+    result = brk(new_value);
+    clock_gettime(CLOCK_MONOTONIC, &after);
+
+    stats.brk_calls++;
+    stats.brk_nanoseconds += (after.tv_sec - before.tv_sec) * 1000000000ULL +
+      after.tv_nsec - before.tv_nsec;
+  } else
+#endif
+  result = brk(new_value);
+
+#if THP_ADVICE
+  /*
+   * Pass on the huge page preference for memory the heap just grew into.
+   * The partial page at the old end already belongs to the heap.
+   */
+  if (!result && config.thp && new_value > max_ptr) {
+    uint8_t *start = (uint8_t *)((uintptr_t)max_ptr & ~(uintptr_t)4095);
+    madvise(start, new_value - start, config.thp == 1 ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+  }
+#endif
+  return !result;
+}
+
 /*
  * Make sure all addresses before "new_value" are valid and can be used. Memory
  * is allocated in a 2gb address range but that memory is not reserved up
@@ -128,15 +1108,44 @@ static uint8_t *max_ptr;
  * will return false if the memory could not be reserved.
  */
 static int update_max_ptr(uint8_t *new_value) {
+#if BUDDY_FIXED_HEAP_LOG2
+  /*
+   * The whole heap was reserved up front. This only fails if that failed.
+   */
+  return new_value <= max_ptr;
+#else
   if (new_value > max_ptr) {
-    if (brk(new_value)) {
+    /*
+     * Round up to the next multiple of the chunk size, as long as that stays
+     * inside our address range. If reserving the whole chunk fails, try again
+     * with just what's needed in case we're close to a resource limit.
+     */
+    if (config.growth_max_log2) {
+      size_t chunk = (size_t)1 << config.growth_min_log2;
+      size_t limit = MAX_ALLOC - (size_t)(new_value - base_ptr);
+      size_t rounded;
+
+      while (chunk < ((size_t)(max_ptr - base_ptr) >> GROWTH_RATIO_LOG2) &&
+          chunk < (size_t)1 << config.growth_max_log2) {
+        chunk *= 2;
+      }
+
+      rounded = (chunk - (uintptr_t)new_value % chunk) % chunk;
+      if (rounded <= limit && move_break(new_value + rounded)) {
+        max_ptr = new_value + rounded;
+        return 1;
+      }
+    }
+    if (!move_break(new_value)) {
       return 0;
     }
     max_ptr = new_value;
   }
   return 1;
+#endif
 }
 
+#if BUDDY_ENGINE == ENGINE_LISTS
 /*
  * Initialize a list to empty. Because these are circular lists, an "empty"
  * list is an entry where both links point to itself. This makes insertion
@@ -182,6 +1191,23 @@ static list_t *list_pop(list_t *list) {
   return back;
 }
 
+/*
+ * Remove and return the entry with the lowest address in the list (or the
+ * highest if "highest" is set) or NULL if the list is empty. This has to
+ * visit every entry in the list.
+ */
+static list_t *list_pop_end(list_t *list, int highest) {
+  list_t *best = list->next;
+  list_t *entry;
+  if (best == list) return NULL;
+  for (entry = best->next; entry != list; entry = entry->next) {
+    if (highest ? entry > best : entry < best) best = entry;
+  }
+  list_remove(best);
+  return best;
+}
+#endif
+
 /*
  * This maps from the index of a node to the address of memory that node
  * represents. The bucket can be derived from the index using a loop but is
@@ -200,11 +1226,81 @@ static uint8_t *ptr_for_node(size_t index, size_t bucket) {
 static size_t node_for_ptr(uint8_t *ptr, size_t bucket) {
   return ((ptr - base_ptr) >> (MAX_ALLOC_LOG2 - bucket)) + (1 << bucket) - 1;
 }
+
+#if BUDDY_ENGINE == ENGINE_BITMAPS || BUDDY_GC
+/*
+ * Return the index of the lowest set bit. The argument must not be zero.
+ */
+static size_t count_trailing_zeros(uint64_t bits) {
+#if defined(__GNUC__)
+  return __builtin_ctzll(bits);
+#else
+  size_t count = 0;
+  while (!(bits & 1)) {
+    bits >>= 1;
+    count++;
+  }
+  return count;
+#endif
+}
+#endif
+
+#if BUDDY_ENGINE == ENGINE_BITMAPS
+/*
+ * Return the index of the highest set bit. The argument must not be zero.
+ */
+static size_t highest_bit(uint64_t bits) {
+#if defined(__GNUC__)
+  return 63 - __builtin_clzll(bits);
+#else
+  size_t index = 0;
+  while (bits >>= 1) index++;
+  return index;
+#endif
+}
+#endif
+
+#if BUDDY_ENGINE != ENGINE_MAX_FREE
+#if BUDDY_BLOCKED_TREE || (BUDDY_MERGE_STEPS && BUDDY_ENGINE == ENGINE_LISTS)
+/*
+ * Return the index of the highest set bit. The argument must not be zero.
+ */
+static size_t floor_log2(size_t value) {
+#if defined(__GNUC__)
+  return sizeof(unsigned long long) * 8 - 1 - __builtin_clzll(value);
+#else
+  size_t log2 = 0;
+  while (value >>= 1) log2++;
+  return log2;
+#endif
+}
+#endif
+
+/*
+ * This maps from the index of a node to the position of its bit in the
+ * "node_is_split" array. This is the identity function unless the blocked
+ * layout is enabled, in which case the bucket (i.e. the depth) of the node is
+ * recovered from its index and used to find the block containing the node.
+ */
+static size_t split_bit_for_node(size_t index) {
+#if BUDDY_BLOCKED_TREE
+  size_t bucket = floor_log2(index + 1);
+  size_t position = index + 1 - ((size_t)1 << bucket);
+  size_t band = bucket / SPLIT_BLOCK_LEVELS;
+  size_t level = bucket % SPLIT_BLOCK_LEVELS;
+  size_t height = band < SPLIT_FULL_BANDS ? SPLIT_BLOCK_LEVELS : SPLIT_LAST_LEVELS;
+  return SPLIT_BAND_OFFSET(band) + ((position >> level) << height) +
+    ((size_t)1 << level) - 1 + (position & (((size_t)1 << level) - 1));
+#else
+  return index;
+#endif
+}
+
 /*
  * Given the index of a node, this returns the "is split" flag of the parent.
  */
 static int parent_is_split(size_t index) {
-  index = (index - 1) / 2;
+  index = split_bit_for_node((index - 1) / 2);
   return (node_is_split[index / 8] >> (index % 8)) & 1;
 }
 
@@ -212,32 +1308,537 @@ static int parent_is_split(size_t index) {
  * Given the index of a node, this flips the "is split" flag of the parent.
  */
 static void flip_parent_is_split(size_t index) {
-  index = (index - 1) / 2;
+  index = split_bit_for_node((index - 1) / 2);
   node_is_split[index / 8] ^= 1 << (index % 8);
 }
 
+#if BUDDY_ENGINE == ENGINE_BITMAPS
+
 /*
- * Given the requested size passed to "malloc", this function returns the index
- * of the smallest bucket that can fit that size.
+ * Set a bit in the provided level of the free bitmap. Setting a bit in a word
+ * that was previously zero means the word is now non-zero, so the summary bit
+ * for that word in the level above needs to be set too.
  */
-static size_t bucket_for_request(size_t request) {
-  size_t bucket = BUCKET_COUNT - 1;
-  size_t size = MIN_ALLOC;
-
-  while (size < request) {
-    bucket--;
-    size *= 2;
+static void free_bitmap_set(size_t level, size_t bit) {
+  for (; level < FREE_BITMAP_LEVELS; level++) {
+    uint64_t *word = free_bitmap + free_bitmap_level[level] + bit / 64;
+    uint64_t old = *word;
+    *word = old | ((uint64_t)1 << (bit % 64));
+    if (old) break;
+    bit /= 64;
   }
-
-  return bucket;
 }
 
+#if BUDDY_REFILL_LOG2
 /*
- * The tree is always rooted at the current bucket limit. This call grows the
- * tree by repeatedly doubling it in size until the root lies at the provided
+ * Set a range of bits in the bottom level of the free bitmap, a word at a
+ * time. Only words that were previously zero need their summary bit set.
+ */
+static void free_bitmap_set_range(size_t bit, size_t count) {
+  while (count) {
+    size_t offset = bit % 64;
+    size_t length = 64 - offset < count ? 64 - offset : count;
+    uint64_t *word = free_bitmap + bit / 64;
+    uint64_t old = *word;
+    *word = old | ((length == 64 ? ~(uint64_t)0 : ((uint64_t)1 << length) - 1) << offset);
+    if (!old) free_bitmap_set(1, bit / 64);
+    bit += length;
+    count -= length;
+  }
+}
+#endif
+
+/*
+ * Clear a bit in the bottom level of the free bitmap. This is the reverse of
+ * "free_bitmap_set" and clears summary bits for words that become zero.
+ */
+static void free_bitmap_clear(size_t bit) {
+  size_t level;
+
+  for (level = 0; level < FREE_BITMAP_LEVELS; level++) {
+    uint64_t *word = free_bitmap + free_bitmap_level[level] + bit / 64;
+    *word &= ~((uint64_t)1 << (bit % 64));
+    if (*word) break;
+    bit /= 64;
+  }
+}
+
+/*
+ * Return the lowest set bit in the range from "start" to "2 * start" in the
+ * provided level of the free bitmap, or 0 if there are no set bits in that
+ * range. Because the range is a power of two, it either lies entirely within
+ * the first word or starts and ends on a word boundary. In the second case,
+ * the summary level is used to find the first non-zero word directly.
+ */
+static size_t free_bitmap_find(size_t level, size_t start) {
+  uint64_t *words = free_bitmap + free_bitmap_level[level];
+  size_t word;
+
+  if (start < 64) {
+    uint64_t mask = ~(((uint64_t)1 << start) - 1);
+    if (start < 32) mask &= ((uint64_t)1 << (start * 2)) - 1;
+    return words[0] & mask ? count_trailing_zeros(words[0] & mask) : 0;
+  }
+
+  word = free_bitmap_find(level + 1, start / 64);
+  return word ? word * 64 + count_trailing_zeros(words[word]) : 0;
+}
+
+/*
+ * This is like "free_bitmap_find" but returns the highest set bit instead.
+ */
+static size_t free_bitmap_find_highest(size_t level, size_t start) {
+  uint64_t *words = free_bitmap + free_bitmap_level[level];
+  size_t word;
+
+  if (start < 64) {
+    uint64_t mask = ~(((uint64_t)1 << start) - 1);
+    if (start < 32) mask &= ((uint64_t)1 << (start * 2)) - 1;
+    return words[0] & mask ? highest_bit(words[0] & mask) : 0;
+  }
+
+  word = free_bitmap_find_highest(level + 1, start / 64);
+  return word ? word * 64 + highest_bit(words[word]) : 0;
+}
+#endif
+
+#if BUDDY_ENGINE == ENGINE_LISTS
+/*
+ * Return the free list for a bucket. Buckets below a cache line are per
+ * thread in thread-safe mode.
+ */
+static list_t *free_list(size_t bucket) {
+#if BUDDY_THREADS
+  if (bucket > LINE_BUCKET) {
+    return &current_cache->buckets[bucket - LINE_BUCKET - 1];
+  }
+#endif
+  return &buckets[bucket];
+}
+#endif
+
+/*
+ * These functions manipulate the set of free blocks for a given bucket. They
+ * hide the difference between the two engines from the rest of the allocator.
+ */
+static void free_init(size_t bucket) {
+#if BUDDY_ENGINE == ENGINE_LISTS
+  list_init(free_list(bucket));
+#else
+  (void)bucket;
+#endif
+}
+
+#if BUDDY_ENGINE == ENGINE_LISTS
+/*
+ * Set or clear the "is free" bit for the node of a block. This does nothing
+ * without "-DBUDDY_FREE_INDEX=1".
+ */
+static void mark_free(uint8_t *ptr, size_t bucket, int is_free) {
+#if FREE_INDEX
+  size_t index = node_for_ptr(ptr, bucket);
+  uint64_t mask = (uint64_t)1 << (index % 64);
+  if (is_free) {
+    node_is_free_bits[index / 64] |= mask;
+  } else {
+    node_is_free_bits[index / 64] &= ~mask;
+  }
+#else
+  (void)ptr;
+  (void)bucket;
+  (void)is_free;
+#endif
+}
+#endif
+
+static void free_push(size_t bucket, uint8_t *ptr) {
+#if BUDDY_ENGINE == ENGINE_LISTS
+  list_push(free_list(bucket), (list_t *)ptr);
+  mark_free(ptr, bucket, 1);
+#else
+  size_t bit = node_for_ptr(ptr, bucket) + 1;
+  free_bitmap_set(0, bit);
+  free_bitmap_last[bucket] = bit;
+#endif
+}
+
+static void free_remove(size_t bucket, uint8_t *ptr) {
+#if BUDDY_ENGINE == ENGINE_LISTS
+  list_remove((list_t *)ptr);
+  mark_free(ptr, bucket, 0);
+#else
+  free_bitmap_clear(node_for_ptr(ptr, bucket) + 1);
+#endif
+}
+
+#if BUDDY_MERGE_STEPS
+/*
+ * Park a free block that could still merge with its buddy.
+ */
+static void park_push(size_t bucket, uint8_t *ptr) {
+#if BUDDY_ENGINE == ENGINE_LISTS
+  list_push(&parked[bucket], (list_t *)ptr);
+  mark_free(ptr, bucket, 1);
+  parked_buckets |= (uint32_t)1 << bucket;
+#else
+  free_push(bucket, ptr);
+  if (parked_count < PARK_SIZE) {
+    parked[parked_count].index = node_for_ptr(ptr, bucket);
+    parked[parked_count].bucket = bucket;
+    parked_count++;
+  }
+#endif
+}
+
+/*
+ * Take a parked block off the set of free blocks and return its node, or
+ * return 0 if there are none. With free lists, the smallest blocks come
+ * first.
+ */
+static size_t park_pop(size_t *bucket) {
+#if BUDDY_ENGINE == ENGINE_LISTS
+  while (parked_buckets) {
+    uint8_t *ptr;
+    *bucket = floor_log2(parked_buckets);
+    ptr = (uint8_t *)list_pop(&parked[*bucket]);
+    if (ptr) {
+      mark_free(ptr, *bucket, 0);
+      return node_for_ptr(ptr, *bucket);
+    }
+    parked_buckets &= ~((uint32_t)1 << *bucket);
+  }
+#else
+  while (parked_count) {
+    size_t index = parked[--parked_count].index;
+    *bucket = parked[parked_count].bucket;
+    if ((free_bitmap[(index + 1) / 64] >> ((index + 1) % 64)) & 1) {
+      free_bitmap_clear(index + 1);
+      return index;
+    }
+  }
+#endif
+  return 0;
+}
+
+/*
+ * Return true if there's a free block in this bucket or a larger one, so
+ * an allocation for this bucket doesn't have to grow the tree.
+ */
+static int free_available(size_t bucket) {
+  for (; bucket + 1 > bucket_limit; bucket--) {
+#if BUDDY_ENGINE == ENGINE_LISTS
+    if (free_list(bucket)->next != free_list(bucket)) return 1;
+#else
+    if (free_bitmap_find(0, (size_t)1 << bucket)) return 1;
+#endif
+  }
+  return 0;
+}
+#endif
+
+#if BUDDY_REFILL_LOG2
+/*
+ * Add "count" adjacent blocks starting at "ptr" to the free list for a bucket.
+ * The bitmap engine does this a word at a time.
+ */
+static void free_push_range(size_t bucket, uint8_t *ptr, size_t count) {
+#if BUDDY_ENGINE == ENGINE_LISTS
+  size_t size = (size_t)1 << (MAX_ALLOC_LOG2 - bucket);
+  while (count--) {
+    free_push(bucket, ptr);
+    ptr += size;
+  }
+#else
+  free_bitmap_set_range(node_for_ptr(ptr, bucket) + 1, count);
+#endif
+}
+#endif
+
+/*
+ * Remove and return the free block with the lowest address in a bucket, or
+ * the highest if "highest" is set, or NULL if the bucket is empty.
+ */
+static uint8_t *free_pop_end(size_t bucket, int highest) {
+#if BUDDY_ENGINE == ENGINE_LISTS
+  uint8_t *ptr = (uint8_t *)list_pop_end(free_list(bucket), highest);
+  if (ptr) mark_free(ptr, bucket, 0);
+  return ptr;
+#else
+  size_t start = (size_t)1 << bucket;
+  size_t bit = highest ? free_bitmap_find_highest(0, start) : free_bitmap_find(0, start);
+  if (!bit) return NULL;
+  free_bitmap_clear(bit);
+  return ptr_for_node(bit - 1, bucket);
+#endif
+}
+
+static uint8_t *free_pop(size_t bucket) {
+  if (config.placement != PLACEMENT_LIFO) {
+    return free_pop_end(bucket, 0);
+  }
+#if BUDDY_ENGINE == ENGINE_LISTS
+  {
+    uint8_t *ptr = (uint8_t *)list_pop(free_list(bucket));
+    if (ptr) mark_free(ptr, bucket, 0);
+    return ptr;
+  }
+#else
+  {
+    size_t bit = free_bitmap_last[bucket];
+    if (bit && (free_bitmap[bit / 64] >> (bit % 64)) & 1) {
+      free_bitmap_clear(bit);
+      return ptr_for_node(bit - 1, bucket);
+    }
+  }
+  return free_pop_end(bucket, 0);
+#endif
+}
+
+#if BUDDY_PRESERVE_LARGE
+/*
+ * Return true if the free block at this node is a good candidate for being
+ * split. That's the case when its buddy is entirely used, which we can tell
+ * because our parent is SPLIT (so our buddy isn't UNUSED) and our buddy isn't
+ * SPLIT (so neither of its children are UNUSED). This is only a heuristic
+ * since a USED buddy may still have free blocks further down.
+ */
+static int is_split_candidate(size_t index) {
+  size_t buddy = ((index - 1) ^ 1) + 1;
+  return index != 0 && parent_is_split(index) && !parent_is_split(buddy * 2 + 1);
+}
+
+/*
+ * This is like "free_pop" but is used when the block is going to be split. It
+ * looks at a few free blocks and prefers one that "is_split_candidate" likes.
+ * If none of them are good candidates, the block "free_pop" would have
+ * returned is used instead.
+ */
+static uint8_t *free_pop_for_split(size_t bucket) {
+#if BUDDY_ENGINE == ENGINE_LISTS
+  list_t *list = free_list(bucket);
+  list_t *entry = list->prev;
+  size_t count;
+
+  if (config.placement != PLACEMENT_LIFO) {
+    return free_pop(bucket);
+  }
+  if (entry == list) return NULL;
+
+  for (count = 0; entry != list && count < SPLIT_CANDIDATES; count++) {
+    if (is_split_candidate(node_for_ptr((uint8_t *)entry, bucket))) {
+      free_remove(bucket, (uint8_t *)entry);
+      return (uint8_t *)entry;
+    }
+    entry = entry->prev;
+  }
+#else
+  size_t start = (size_t)1 << bucket;
+  size_t bit = free_bitmap_find(0, start);
+  size_t count;
+  uint64_t word;
+
+  if (config.placement == PLACEMENT_TWO_ENDED) {
+    return free_pop(bucket);
+  }
+  if (!bit) return NULL;
+  word = free_bitmap[bit / 64] >> (bit % 64);
+
+  for (count = 0; word && count < SPLIT_CANDIDATES; count++) {
+    size_t candidate = bit + count_trailing_zeros(word);
+    if (candidate >= start * 2) break;
+    if (is_split_candidate(candidate - 1)) {
+      free_bitmap_clear(candidate);
+      return ptr_for_node(candidate - 1, bucket);
+    }
+    word &= word - 1;
+  }
+#endif
+
+  STAT(stats.buckets[bucket].unpreferred_splits++);
+  return free_pop(bucket);
+}
+#else
+#define free_pop_for_split free_pop
+#endif
+#else
+/*
+ * Recompute the bytes for the ancestors of a node whose byte just changed.
+ * A parent is entirely free if both children are, otherwise it's the larger
+ * of its children. We can stop early once a parent doesn't change since its
+ * ancestors won't change either.
+ */
+static void max_free_update_parents(size_t index, size_t bucket) {
+  while (index != 0) {
+    uint8_t left, right, value;
+    index = (index - 1) / 2;
+    bucket--;
+    left = node_max_free[index * 2 + 1];
+    right = node_max_free[index * 2 + 2];
+    if (left == right && left == BUCKET_COUNT - bucket - 1) {
+      value = left + 1;
+    } else {
+      value = left > right ? left : right;
+    }
+    if (node_max_free[index] == value) {
+      break;
+    }
+    node_max_free[index] = value;
+  }
+}
+
+/*
+ * Return the node of the rightmost free block for the provided bucket in the
+ * subtree rooted at node "i" (which is in bucket "depth") that lies entirely
+ * below "max_ptr", or 0 if there isn't one. Only subtrees that contain
+ * "max_ptr" can fail after passing the checks at the top, and there is one
+ * of those per level, so this visits O(log N) nodes.
+ */
+static size_t max_free_find_highest(size_t i, size_t depth, size_t bucket) {
+  size_t size = (size_t)1 << (MAX_ALLOC_LOG2 - bucket);
+  uint8_t *end = ptr_for_node(i, depth) + ((size_t)1 << (MAX_ALLOC_LOG2 - depth));
+  size_t found;
+
+  if (node_max_free[i] < BUCKET_COUNT - bucket || ptr_for_node(i, depth) + size > max_ptr) {
+    return 0;
+  }
+
+  /*
+   * The children of an entirely free node haven't been initialized, but any
+   * block inside it will do, so pick the last one that ends in time.
+   */
+  if (node_max_free[i] == BUCKET_COUNT - depth) {
+    return node_for_ptr((end < max_ptr ? end : max_ptr) - size, bucket);
+  }
+
+  found = max_free_find_highest(i * 2 + 2, depth + 1, bucket);
+  return found ? found : max_free_find_highest(i * 2 + 1, depth + 1, bucket);
+}
+
+/*
+ * Return the node of the leftmost entirely free block for the provided
+ * bucket, or 0 if there isn't one.
+ */
+static size_t max_free_find_lowest(size_t bucket) {
+  size_t i = 0, depth = 0;
+
+  if (node_max_free[0] < BUCKET_COUNT - bucket) {
+    return 0;
+  }
+  for (; depth < bucket && node_max_free[i] != BUCKET_COUNT - depth; depth++) {
+    i = node_max_free[i * 2 + 1] >= BUCKET_COUNT - bucket ? i * 2 + 1 : i * 2 + 2;
+  }
+  return ((i + 1) << (bucket - depth)) - 1;
+}
+
+/*
+ * Initialize the children of every entirely free node on the path from the
+ * root to node "target" (which is in the provided bucket), the way that
+ * "max_free_alloc" does on its way down, so that the target can be used as
+ * the root of a subtree.
+ */
+static void max_free_open_path(size_t target, size_t bucket) {
+  size_t i = 0, depth = 0;
+
+  for (; depth < bucket; depth++) {
+    if (node_max_free[i] == BUCKET_COUNT - depth) {
+      node_max_free[i * 2 + 1] = BUCKET_COUNT - depth - 1;
+      node_max_free[i * 2 + 2] = BUCKET_COUNT - depth - 1;
+    }
+    i = ((target + 1) >> (bucket - depth - 1)) - 1;
+  }
+}
+
+/*
+ * Find the leftmost free block for the provided bucket in the subtree rooted
+ * at node "i" (which is in bucket "depth"), mark it as used, and return its
+ * address. This returns NULL if there is no free block that's large enough or
+ * if the memory for the block couldn't be reserved. With "highest" set, the
+ * rightmost block that doesn't need more memory to be reserved is taken
+ * instead if there is one.
+ */
+static uint8_t *max_free_alloc(size_t i, size_t depth, size_t bucket, int highest) {
+  uint8_t needed = BUCKET_COUNT - bucket;
+  size_t target = 0;
+  uint8_t *ptr;
+
+  if (node_max_free[i] < needed) {
+    return NULL;
+  }
+  if (highest) {
+    target = max_free_find_highest(i, depth, bucket);
+  }
+
+  /*
+   * Descend from there, preferring the left child whenever it has a block
+   * that's large enough. If the node we're leaving is entirely free, its
+   * children haven't been initialized yet so they're both set to entirely
+   * free first. That doesn't change the value of the node itself, so there's
+   * nothing to undo if we fail later on. If there's a target block, we
+   * head for the child that contains it instead.
+   */
+  for (; depth < bucket; depth++) {
+    if (node_max_free[i] == BUCKET_COUNT - depth) {
+      node_max_free[i * 2 + 1] = BUCKET_COUNT - depth - 1;
+      node_max_free[i * 2 + 2] = BUCKET_COUNT - depth - 1;
+    }
+    if (target) {
+      i = ((target + 1) >> (bucket - depth - 1)) - 1;
+    } else {
+      i = node_max_free[i * 2 + 1] >= needed ? i * 2 + 1 : i * 2 + 2;
+    }
+  }
+
+  ptr = ptr_for_node(i, bucket);
+  if (!update_max_ptr(ptr + ((size_t)1 << (MAX_ALLOC_LOG2 - bucket)))) {
+    return NULL;
+  }
+
+  node_max_free[i] = 0;
+  max_free_update_parents(i, bucket);
+  return ptr;
+}
+#endif
+
+/*
+ * Given the requested size passed to "malloc", this function returns the index
+ * of the smallest bucket that can fit that size.
+ */
+static size_t bucket_for_request(size_t request) {
+  size_t bucket = BUCKET_COUNT - 1;
+  size_t size = MIN_ALLOC;
+
+  while (size < request) {
+    bucket--;
+    size *= 2;
+  }
+
+  return bucket;
+}
+
+#if BUDDY_ENGINE != ENGINE_MAX_FREE
+/*
+ * The tree is always rooted at the current bucket limit. This call grows the
+ * tree by repeatedly doubling it in size until the root lies at the provided
  * bucket index. Each doubling lowers the bucket limit by 1.
  */
 static int lower_bucket_limit(size_t bucket) {
+#if BUDDY_FIXED_HEAP_LOG2
+  if (bucket < FIXED_BUCKET) {
+    return 0;
+  }
+#endif
+
+  /*
+   * If the tree is in use, every level we add below puts a free list entry at
+   * the start of a new right child and the last one is the furthest out. So
+   * reserve the memory for all of them at once up front, which means growing
+   * the tree by several levels only needs a single call to "brk".
+   */
+  if (bucket < bucket_limit && parent_is_split(node_for_ptr(base_ptr, bucket_limit)) &&
+      !update_max_ptr(base_ptr + ((size_t)1 << (MAX_ALLOC_LOG2 - bucket - 1)) + FREE_ENTRY_SIZE)) {
+    return 0;
+  }
+
   while (bucket < bucket_limit) {
     size_t root = node_for_ptr(base_ptr, bucket_limit);
     uint8_t *right_child;
@@ -248,27 +1849,24 @@ static int lower_bucket_limit(size_t bucket) {
      * clear the root free list, increase the bucket limit, and add a single
      * block with the newly-expanded address space to the new root free list.
      */
+    STAT(stats.buckets[bucket_limit - 1].tree_growths++);
     if (!parent_is_split(root)) {
-      list_remove((list_t *)base_ptr);
-      list_init(&buckets[--bucket_limit]);
-      list_push(&buckets[bucket_limit], (list_t *)base_ptr);
+      free_remove(bucket_limit, base_ptr);
+      free_init(--bucket_limit);
+      free_push(bucket_limit, base_ptr);
       continue;
     }
 
     /*
      * Otherwise, the tree is currently in use. Create a parent node for the
      * current root node in the SPLIT state with a right child on the free
-     * list. Make sure to reserve the memory for the free list entry before
-     * writing to it. Note that we do not need to flip the "is split" flag for
-     * our current parent because it's already on (we know because we just
-     * checked it above).
+     * list. The memory for the free list entry was reserved above. Note that
+     * we do not need to flip the "is split" flag for our current parent
+     * because it's already on (we know because we just checked it above).
      */
     right_child = ptr_for_node(root + 1, bucket_limit);
-    if (!update_max_ptr(right_child + sizeof(list_t))) {
-      return 0;
-    }
-    list_push(&buckets[bucket_limit], (list_t *)right_child);
-    list_init(&buckets[--bucket_limit]);
+    free_push(bucket_limit, right_child);
+    free_init(--bucket_limit);
 
     /*
      * Set the grandparent's SPLIT flag so if we need to lower the bucket limit
@@ -283,37 +1881,112 @@ static int lower_bucket_limit(size_t bucket) {
   return 1;
 }
 
-void *malloc(size_t request) {
-  size_t original_bucket, bucket;
-
+/*
+ * Take a free block that has already been removed from its free list and
+ * mark it as USED, then split it down to the target bucket, adding the
+ * unused halves to the free lists. This returns the address of the part of
+ * the block that ends up being used, which is the leftmost part unless
+ * "rightmost" is set. The caller must have reserved the memory for the free
+ * list entries that are written.
+ */
+static uint8_t *split_block(uint8_t *ptr, size_t bucket, size_t target,
+    int rightmost) {
   /*
-   * Make sure it's possible for an allocation of this size to succeed. There's
-   * a hard-coded limit on the maximum allocation size because of the way this
-   * allocator works.
+   * Change the node from UNUSED to USED. This involves flipping our parent's
+   * "is split" bit because that bit is the exclusive-or of the UNUSED flags of
+   * both children, and our UNUSED flag (which isn't ever stored explicitly)
+   * has just changed.
+   *
+   * Note that we shouldn't ever need to flip the "is split" bit of our
+   * grandparent because we know our buddy is USED so it's impossible for our
+   * grandparent to be UNUSED (if our buddy chunk was UNUSED, our parent
+   * wouldn't ever have been split in the first place).
    */
-  if (request + HEADER_SIZE > MAX_ALLOC) {
-    return NULL;
+  size_t i = node_for_ptr(ptr, bucket);
+  if (i != 0) {
+    flip_parent_is_split(i);
   }
 
   /*
-   * Initialize our global state if this is the first call to "malloc". At the
-   * beginning, the tree has a single node that represents the smallest
-   * possible allocation size. More memory will be reserved later as needed.
+   * If the node is larger than we need, split it down to the correct size and
+   * put the new unused child nodes on the free list in the corresponding
+   * bucket. This is done by repeatedly moving to one child, splitting the
+   * parent, and then adding the other child to the free list.
    */
-  if (base_ptr == NULL) {
-    base_ptr = max_ptr = (uint8_t *)sbrk(0);
-    bucket_limit = BUCKET_COUNT - 1;
-    update_max_ptr(base_ptr + sizeof(list_t));
-    list_init(&buckets[BUCKET_COUNT - 1]);
-    list_push(&buckets[BUCKET_COUNT - 1], (list_t *)base_ptr);
+  while (bucket < target) {
+    STAT(stats.buckets[bucket].splits++);
+    i = i * 2 + 1;
+    bucket++;
+    flip_parent_is_split(i);
+    if (rightmost) {
+      free_push(bucket, ptr_for_node(i, bucket));
+      i++;
+    } else {
+      free_push(bucket, ptr_for_node(i + 1, bucket));
+    }
   }
 
+  return ptr_for_node(i, bucket);
+}
+#endif
+
+/*
+ * While a block with a lifetime class is starting a new region, this is the
+ * end of the heap that "alloc_block" takes the region from (1 for the high
+ * end). It's -1 the rest of the time.
+ */
+static int lifetime_end = -1;
+
+#if BUDDY_ENGINE == ENGINE_MAX_FREE
+/*
+ * Allocate a block for the provided bucket and return its address, or NULL if
+ * there isn't enough memory.
+ */
+static uint8_t *alloc_block(size_t bucket) {
+  uint8_t *ptr;
+
   /*
-   * Find the smallest bucket that will fit this request. This doesn't check
-   * that there's space for the request yet.
+   * A block that starts a new region for a lifetime class goes at the end of
+   * an entirely free region if there is one. For the high end, a region
+   * above "max_ptr" is only used if there isn't one below it.
    */
-  bucket = bucket_for_request(request + HEADER_SIZE);
-  original_bucket = bucket;
+  if (lifetime_end >= 0 && bucket > REGION_BUCKET) {
+    size_t region = lifetime_end ? max_free_find_highest(0, 0, REGION_BUCKET) : 0;
+    if (!region) {
+      region = max_free_find_lowest(REGION_BUCKET);
+    }
+    if (region) {
+      max_free_open_path(region, REGION_BUCKET);
+      ptr = max_free_alloc(region, REGION_BUCKET, bucket, lifetime_end);
+      if (ptr) {
+        return ptr;
+      }
+    }
+  }
+  return max_free_alloc(0, 0, bucket, lifetime_end >= 0 ? lifetime_end :
+    config.placement == PLACEMENT_TWO_ENDED && bucket <= LARGE_BUCKET);
+}
+
+/*
+ * Release a block that was returned by "alloc_block" for the provided bucket.
+ * With the max-free engine, all we need to do is mark this node as entirely
+ * free again and update the maxima of its ancestors. Buddies are merged
+ * implicitly because a parent with two entirely free children is entirely
+ * free too.
+ */
+static void free_block(uint8_t *ptr, size_t bucket) {
+  size_t i = node_for_ptr(ptr, bucket);
+  node_max_free[i] = BUCKET_COUNT - bucket;
+  max_free_update_parents(i, bucket);
+}
+#else
+/*
+ * Allocate a block for the provided bucket and return its address, or NULL if
+ * there isn't enough memory.
+ */
+static uint8_t *alloc_block_from(size_t original_bucket, size_t bucket, int end) {
+  size_t split_bucket = original_bucket;
+  int highest = end == 1;
 
   /*
    * Search for a bucket with a non-empty free list that's as large or larger
@@ -321,7 +1994,7 @@ void *malloc(size_t request) {
    * larger one to get a match.
    */
   while (bucket + 1 != 0) {
-    size_t size, bytes_needed, i;
+    size_t size, bytes_needed;
     uint8_t *ptr;
 
     /*
@@ -336,7 +2009,8 @@ void *malloc(size_t request) {
      * Try to pop a block off the free list for this bucket. If the free list
      * is empty, we're going to have to split a larger block instead.
      */
-    ptr = (uint8_t *)list_pop(&buckets[bucket]);
+    ptr = end >= 0 ? free_pop_end(bucket, end) :
+      bucket < original_bucket ? free_pop_for_split(bucket) : free_pop(bucket);
     if (!ptr) {
       /*
        * If we're not at the root of the tree or it's impossible to grow the
@@ -357,104 +2031,117 @@ void *malloc(size_t request) {
       if (!lower_bucket_limit(bucket - 1)) {
         return NULL;
       }
-      ptr = (uint8_t *)list_pop(&buckets[bucket]);
+      ptr = free_pop(bucket);
     }
 
     /*
      * Try to expand the address space first before going any further. If we
      * have run out of space, put this block back on the free list and fail.
+     * When splitting, the free list entry for the first right child is the
+     * furthest thing we write to (unless the engine doesn't write to free
+     * blocks at all, in which case it's the end of the returned block).
      */
     size = (size_t)1 << (MAX_ALLOC_LOG2 - bucket);
-    bytes_needed = bucket < original_bucket ? size / 2 + sizeof(list_t) : size;
+    bytes_needed = (size_t)1 << (MAX_ALLOC_LOG2 - original_bucket);
+#if BUDDY_REFILL_LOG2
+    /*
+     * If we're about to split a block that's at least as large as the refill
+     * size for a small request, split it only down to the refill size here.
+     * The free list entry of the last carved block is then written to too.
+     */
+    if (bucket <= REFILL_BUCKET &&
+        original_bucket >= REFILL_BUCKET + REFILL_MIN_BLOCKS_LOG2) {
+      size_t last_entry = ((size_t)1 << BUDDY_REFILL_LOG2) - bytes_needed + FREE_ENTRY_SIZE;
+      split_bucket = REFILL_BUCKET;
+      if (last_entry > bytes_needed) {
+        bytes_needed = last_entry;
+      }
+    }
+#endif
+    if (highest) {
+      bytes_needed = size;
+    } else if (bucket < split_bucket && size / 2 + FREE_ENTRY_SIZE > bytes_needed) {
+      bytes_needed = size / 2 + FREE_ENTRY_SIZE;
+    }
     if (!update_max_ptr(ptr + bytes_needed)) {
-      list_push(&buckets[bucket], (list_t *)ptr);
+      free_push(bucket, ptr);
       return NULL;
     }
 
     /*
-     * If we got a node off the free list, change the node from UNUSED to USED.
-     * This involves flipping our parent's "is split" bit because that bit is
-     * the exclusive-or of the UNUSED flags of both children, and our UNUSED
-     * flag (which isn't ever stored explicitly) has just changed.
-     *
-     * Note that we shouldn't ever need to flip the "is split" bit of our
-     * grandparent because we know our buddy is USED so it's impossible for our
-     * grandparent to be UNUSED (if our buddy chunk was UNUSED, our parent
-     * wouldn't ever have been split in the first place).
+     * Mark the block as used and split off what we don't need. We keep the
+     * leftmost part (or the rightmost part for a large request with two-ended
+     * placement), which means the memory reserved above covers everything
+     * that's written.
      */
-    i = node_for_ptr(ptr, bucket);
-    if (i != 0) {
-      flip_parent_is_split(i);
-    }
+    ptr = split_block(ptr, bucket, split_bucket, highest);
 
+#if BUDDY_REFILL_LOG2
     /*
-     * If the node we got is larger than we need, split it down to the correct
-     * size and put the new unused child nodes on the free list in the
-     * corresponding bucket. This is done by repeatedly moving to the left
-     * child, splitting the parent, and then adding the right child to the free
-     * list.
+     * Carve the refill block into blocks of the requested size and put all of
+     * them except the first one on the free list. The first one is returned,
+     * so flip its parent's "is split" bit since it's now USED while its buddy
+     * is UNUSED.
      */
-    while (bucket < original_bucket) {
-      i = i * 2 + 1;
-      bucket++;
-      flip_parent_is_split(i);
-      list_push(&buckets[bucket], (list_t *)ptr_for_node(i + 1, bucket));
+    if (split_bucket != original_bucket) {
+      free_push_range(original_bucket, ptr + ((size_t)1 << (MAX_ALLOC_LOG2 - original_bucket)),
+        ((size_t)1 << (original_bucket - split_bucket)) - 1);
+      flip_parent_is_split(node_for_ptr(ptr, original_bucket));
     }
+#endif
 
-    /*
-     * Now that we have a memory address, write the block header (just the size
-     * of the allocation) and return the address immediately after the header.
-     */
-    *(size_t *)ptr = request;
-    return ptr + HEADER_SIZE;
+    return ptr;
   }
 
   return NULL;
 }
 
-void free(void *ptr) {
-  size_t bucket, i;
-
-  /*
-   * Ignore any attempts to free a NULL pointer.
-   */
-  if (!ptr) {
-    return;
+/*
+ * Allocate a block for the provided bucket and return its address, or NULL if
+ * there isn't enough memory. A block that starts a new region for a lifetime
+ * class is split off a free block of at least a whole region if there is one.
+ */
+static uint8_t *alloc_block(size_t bucket) {
+  if (lifetime_end >= 0) {
+    uint8_t *ptr = bucket > REGION_BUCKET ? alloc_block_from(bucket, REGION_BUCKET, lifetime_end) : NULL;
+    return ptr ? ptr : alloc_block_from(bucket, bucket, lifetime_end);
   }
+  return alloc_block_from(bucket, bucket,
+    config.placement == PLACEMENT_TWO_ENDED && bucket <= LARGE_BUCKET ? 1 : -1);
+}
 
+/*
+ * Traverse up to the root node from an UNUSED node that isn't on a free list
+ * yet and whose "is split" bit has already been flipped, merging UNUSED
+ * buddies together into a single UNUSED parent. This does at most "steps"
+ * merges (parking the block if it could have done more) and returns how many
+ * steps are left.
+ */
+static size_t merge_block(size_t i, size_t bucket, size_t steps) {
   /*
-   * We were given the address returned by "malloc" so get back to the actual
-   * address of the node by subtracting off the size of the block header. Then
-   * look up the index of the node corresponding to this address.
-   */
-  ptr = (uint8_t *)ptr - HEADER_SIZE;
-  bucket = bucket_for_request(*(size_t *)ptr + HEADER_SIZE);
-  i = node_for_ptr((uint8_t *)ptr, bucket);
-
-  /*
-   * Traverse up to the root node, flipping USED blocks to UNUSED and merging
-   * UNUSED buddies together into a single UNUSED parent.
+   * If the parent is SPLIT, that means our buddy is USED, so don't merge with
+   * it. Instead, stop the iteration here and add ourselves to the free list
+   * for our bucket.
+   *
+   * Also stop here if we're at the current root node, even if that root node
+   * is now UNUSED. Root nodes don't have a buddy so we can't merge with one.
    */
-  while (i != 0) {
+  while (i != 0 && !parent_is_split(i) && bucket != bucket_limit) {
+#if BUDDY_MERGE_STEPS
     /*
-     * Change this node from UNUSED to USED. This involves flipping our
-     * parent's "is split" bit because that bit is the exclusive-or of the
-     * UNUSED flags of both children, and our UNUSED flag (which isn't ever
-     * stored explicitly) has just changed.
-     */
-    flip_parent_is_split(i);
-
-    /*
-     * If the parent is now SPLIT, that means our buddy is USED, so don't merge
-     * with it. Instead, stop the iteration here and add ourselves to the free
-     * list for our bucket.
-     *
-     * Also stop here if we're at the current root node, even if that root node
-     * is now UNUSED. Root nodes don't have a buddy so we can't merge with one.
+     * Blocks smaller than a cache line are merged on the per-thread lists in
+     * thread-safe mode, so those merges always finish. There are only a few
+     * levels of them.
      */
-    if (parent_is_split(i) || bucket == bucket_limit) {
-      break;
+#if BUDDY_THREADS
+    if (bucket <= LINE_BUCKET && steps-- == 0) {
+#else
+    if (steps-- == 0) {
+#endif
+      park_push(bucket, ptr_for_node(i, bucket));
+      return 0;
     }
+#endif
 
     /*
      * If we get here, we know our buddy is UNUSED. In this case we should
@@ -463,9 +2150,19 @@ void free(void *ptr) {
      * add the merged parent to its free list yet. That will be done once after
      * this loop is finished.
      */
-    list_remove((list_t *)ptr_for_node(((i - 1) ^ 1) + 1, bucket));
+    free_remove(bucket, ptr_for_node(((i - 1) ^ 1) + 1, bucket));
     i = (i - 1) / 2;
     bucket--;
+
+    /*
+     * Change the parent from USED to UNUSED. This involves flipping its
+     * parent's "is split" bit because that bit is the exclusive-or of the
+     * UNUSED flags of both children, and its UNUSED flag (which isn't ever
+     * stored explicitly) has just changed.
+     */
+    if (i != 0) {
+      flip_parent_is_split(i);
+    }
   }
 
   /*
@@ -474,5 +2171,2638 @@ void free(void *ptr) {
    * followed by a "malloc" of the same size to ideally use the same address
    * for better memory locality.
    */
-  list_push(&buckets[bucket], (list_t *)ptr_for_node(i, bucket));
+  free_push(bucket, ptr_for_node(i, bucket));
+  return steps;
+}
+
+/*
+ * Release a block that was returned by "alloc_block" for the provided bucket.
+ */
+static void free_block(uint8_t *ptr, size_t bucket) {
+  size_t i = node_for_ptr(ptr, bucket);
+
+  /*
+   * Change this node from USED to UNUSED, then merge it with its buddies.
+   */
+  if (i != 0) {
+    flip_parent_is_split(i);
+  }
+#if BUDDY_MERGE_STEPS
+  merge_block(i, bucket, config.merge_steps);
+#else
+  merge_block(i, bucket, 0);
+#endif
+}
+
+#if BUDDY_MERGE_STEPS
+/*
+ * Spend up to "steps" merge steps on parked blocks. This returns true if
+ * there are parked blocks left.
+ */
+static int merge_parked(size_t steps) {
+  size_t i, bucket;
+
+  while (steps && (i = park_pop(&bucket))) {
+    steps = merge_block(i, bucket, steps);
+  }
+  return !steps;
+}
+#endif
+#endif
+
+#if BUDDY_CACHE_COLORING
+/*
+ * Return how far the header of a block is shifted forward from the start of
+ * the block, given the size that was originally requested for it.
+ */
+static size_t color_offset(uint8_t *ptr, size_t bucket, size_t request) {
+  size_t size_log2 = MAX_ALLOC_LOG2 - bucket;
+  size_t lines, color;
+  if (size_log2 < COLOR_MIN_LOG2) {
+    return 0;
+  }
+  lines = (((size_t)1 << size_log2) - HEADER_SIZE - request) / CACHE_LINE_SIZE;
+  color = ((size_t)(ptr - base_ptr) >> size_log2) % COLOR_COUNT;
+  return color % (lines + 1) * CACHE_LINE_SIZE;
+}
+#endif
+
+#if BUDDY_TAGS
+/*
+ * This is the state for tags. Quotas of 0 mean no quota. "pending_tag" is the
+ * tag for allocations made while it isn't negative, which is how
+ * "malloc_tagged", "realloc" and compaction override the thread's tag.
+ */
+static size_t tag_bytes[BUDDY_TAGS];
+static size_t tag_soft_quota[BUDDY_TAGS];
+static size_t tag_hard_quota[BUDDY_TAGS];
+static void (*tag_callback)(int tag, size_t bytes);
+static int pending_tag = -1;
+
+/*
+ * The usage counters are global rather than kept per thread and added up
+ * when asked for. Every call already holds the one lock, so per-thread
+ * counters wouldn't save any contention, and the quotas need the exact
+ * total on every allocation, which would mean adding up all the slots each
+ * time.
+ *
+ * A soft quota crossed by "tag_charge" is remembered in "quota_tag" and
+ * "quota_bytes" and reported by "unlock_for_thread" once the lock is
+ * released, so that the callback can allocate memory.
+ */
+static int quota_tag = -1;
+static size_t quota_bytes;
+
+/*
+ * The tag set by "buddy_set_thread_tag" is kept in thread-local storage
+ * rather than in the thread's slot, so threads without a slot don't share
+ * one. The initial-exec model keeps the thread library from allocating
+ * memory the first time a thread reads it.
+ */
+#if BUDDY_THREADS
+static __thread int thread_tag __attribute__((tls_model("initial-exec")));
+#else
+static int thread_tag;
+#endif
+
+/*
+ * Return the tag that a new allocation is charged to.
+ */
+static int allocation_tag(void) {
+  if (pending_tag >= 0) {
+    return pending_tag;
+  }
+  return thread_tag;
+}
+
+/*
+ * Return the tag of a block returned by "malloc".
+ */
+static int tag_for_payload(void *payload) {
+  return (int)((*(size_t *)((uint8_t *)payload - HEADER_SIZE) & TAG_MASK) >> TAG_SHIFT);
+}
+
+/*
+ * Return false if a block from this bucket would put the allocation's tag
+ * over its hard quota.
+ */
+static int tag_admit(size_t bucket) {
+  int tag = allocation_tag();
+  size_t size = (size_t)1 << (MAX_ALLOC_LOG2 - bucket);
+  return !tag_hard_quota[tag] || tag_bytes[tag] + size <= tag_hard_quota[tag];
+}
+
+/*
+ * Charge a new block to a tag, or refund a freed one. Charging remembers
+ * the tag for the callback if that crosses the tag's soft quota.
+ */
+static void tag_charge(int tag, size_t bucket) {
+  size_t old = tag_bytes[tag];
+  tag_bytes[tag] = old + ((size_t)1 << (MAX_ALLOC_LOG2 - bucket));
+  if (tag_soft_quota[tag] && old <= tag_soft_quota[tag] && tag_bytes[tag] > tag_soft_quota[tag]) {
+    quota_tag = tag;
+    quota_bytes = tag_bytes[tag];
+  }
+}
+
+static void tag_refund(int tag, size_t bucket) {
+  tag_bytes[tag] -= (size_t)1 << (MAX_ALLOC_LOG2 - bucket);
+}
+#endif
+
+#if BUDDY_RSS_LIMITS
+/*
+ * This is the state for RSS limits. "rss_in_use" is the number of bytes in
+ * live blocks and "rss_estimate" is how much of the heap may be resident,
+ * which can be less than that if some live blocks were never touched. The
+ * limits are in "config" and 0 means no limit.
+ */
+static size_t rss_in_use;
+static size_t rss_estimate;
+static void (*pressure_callback)(size_t size);
+#endif
+
+/*
+ * Write the block header for a newly-allocated block and return the address
+ * to give back to the caller, which is the address right after the header.
+ * With cache coloring, the header may be moved forward into the unused space
+ * at the end of the block (see BUDDY_CACHE_COLORING).
+ */
+static void *payload_for_block(uint8_t *ptr, size_t bucket, size_t request) {
+#if BUDDY_TAGS
+  int tag = allocation_tag();
+  tag_charge(tag, bucket);
+  request |= (size_t)tag << TAG_SHIFT;
+#endif
+#if BUDDY_RSS_LIMITS
+  rss_in_use += (size_t)1 << (MAX_ALLOC_LOG2 - bucket);
+  rss_estimate += (size_t)1 << (MAX_ALLOC_LOG2 - bucket);
+  if (rss_estimate > (size_t)(max_ptr - base_ptr)) {
+    rss_estimate = max_ptr - base_ptr;
+  }
+#endif
+#if BUDDY_CACHE_COLORING
+  if (MAX_ALLOC_LOG2 - bucket >= COLOR_MIN_LOG2) {
+    *(size_t *)ptr = request;
+    ptr += color_offset(ptr, bucket, HEADER_REQUEST(request));
+  }
+#else
+  (void)bucket;
+#endif
+#if BUDDY_THREADS
+  /*
+   * Record which slot's free lists a small block belongs to. Those blocks are
+   * never colored so the header is always at the start of the block.
+   */
+  if (HEADER_REQUEST(request) + HEADER_SIZE <= CACHE_LINE_SIZE / 2) {
+    request |= OWNER_FLAG | (size_t)(current_cache - thread_caches) << CACHE_LINE_LOG2;
+  }
+#endif
+  *(size_t *)ptr = request;
+  return ptr + HEADER_SIZE;
+}
+
+/*
+ * This is the reverse of "payload_for_block". It returns the start of the
+ * block for an address that was returned to the caller and sets "bucket" to
+ * the bucket of that block.
+ */
+static uint8_t *block_for_payload(void *payload, size_t *bucket) {
+  uint8_t *ptr = (uint8_t *)payload - HEADER_SIZE;
+#if BUDDY_THREADS
+  size_t header = *(size_t *)ptr;
+  if (header & OWNER_FLAG) {
+    *bucket = HEADER_REQUEST(header & ~OWNER_FLAG) >> CACHE_LINE_LOG2 == NO_OWNER ? LINE_BUCKET :
+      bucket_for_request((header & (CACHE_LINE_SIZE - 1)) + HEADER_SIZE);
+    return ptr;
+  }
+#endif
+  *bucket = bucket_for_request(HEADER_REQUEST(*(size_t *)ptr) + HEADER_SIZE);
+#if BUDDY_CACHE_COLORING
+  if (MAX_ALLOC_LOG2 - *bucket >= COLOR_MIN_LOG2) {
+    size_t mask = ((size_t)1 << (MAX_ALLOC_LOG2 - *bucket)) - 1;
+    ptr = base_ptr + ((size_t)(ptr - base_ptr) & ~mask);
+  }
+#endif
+  return ptr;
+}
+
+#if BUDDY_THREADS
+/*
+ * Return the slot whose free lists a block returned by "malloc" belongs to.
+ * Blocks of a cache line or more don't belong to any slot.
+ */
+static thread_cache_t *cache_for_payload(void *payload) {
+  size_t header = *(size_t *)((uint8_t *)payload - HEADER_SIZE);
+  if (!(header & OWNER_FLAG)) {
+    return &thread_caches[NO_OWNER];
+  }
+  return &thread_caches[HEADER_REQUEST(header & ~OWNER_FLAG) >> CACHE_LINE_LOG2];
+}
+
+/*
+ * When a thread exits, its slot becomes available again. Free blocks on its
+ * lists stay there and will be used by the next thread that gets the slot.
+ */
+static void release_thread_cache(void *cache) {
+  LOCK();
+  ((thread_cache_t *)cache)->in_use = 0;
+  UNLOCK();
+}
+
+static void create_thread_key(void) {
+  pthread_key_create(&thread_key, release_thread_cache);
+  thread_key_ready = 1;
+}
+
+/*
+ * These keep "fork" from copying the lock while another thread holds it,
+ * which would leave the child unable to allocate. The child only has the
+ * forking thread, so the other slots are released and the reclaimer is
+ * started again when it is next needed.
+ */
+static void fork_prepare(void) {
+  LOCK();
+}
+
+static void fork_parent(void) {
+  UNLOCK();
+}
+
+static void fork_child(void) {
+  static const pthread_once_t once_init = PTHREAD_ONCE_INIT;
+  thread_cache_t *cache = thread_key_ready ? pthread_getspecific(thread_key) : NULL;
+  size_t slot;
+
+  for (slot = 0; slot < NO_OWNER; slot++) {
+    if (&thread_caches[slot] != cache) {
+      thread_caches[slot].in_use = 0;
+    }
+  }
+  reclaimer_once = once_init;
+  pthread_mutex_init(&reclaimer_lock, NULL);
+  pthread_cond_init(&reclaimer_wake, NULL);
+  pthread_mutex_init(&lock, NULL);
+}
+
+/*
+ * Return the calling thread's slot. A thread is given a slot the first time
+ * it gets here. The thread-specific value is read and written without holding
+ * the lock in case the thread library allocates memory while doing that.
+ */
+static thread_cache_t *cache_for_thread(void) {
+  thread_cache_t *cache;
+
+  pthread_once(&thread_key_once, create_thread_key);
+  cache = (thread_cache_t *)pthread_getspecific(thread_key);
+
+  if (!cache) {
+    size_t slot, bucket;
+
+    LOCK();
+    for (slot = 0; slot < NO_OWNER && thread_caches[slot].in_use; slot++) {
+    }
+    cache = &thread_caches[slot];
+    if (slot != NO_OWNER) {
+      cache->in_use = 1;
+      if (!cache->buckets[0].next) {
+        for (bucket = 0; bucket < BUCKET_COUNT - LINE_BUCKET - 1; bucket++) {
+          list_init(&cache->buckets[bucket]);
+        }
+      }
+    }
+    UNLOCK();
+    pthread_setspecific(thread_key, cache);
+  }
+
+  return cache;
+}
+
+/*
+ * Take the lock for an allocation by the calling thread and make the calling
+ * thread's slot current.
+ */
+static void lock_for_thread(void) {
+  thread_cache_t *cache = cache_for_thread();
+  LOCK();
+  current_cache = cache;
+}
+#else
+#define lock_for_thread() ((void)0)
+#endif
+
+/*
+ * Release the lock taken by "lock_for_thread" and then call the quota
+ * callback if the allocation crossed a soft quota.
+ */
+static void unlock_for_thread(void) {
+#if BUDDY_TAGS
+  void (*callback)(int tag, size_t bytes) = tag_callback;
+  int tag = quota_tag;
+  size_t bytes = quota_bytes;
+  quota_tag = -1;
+  UNLOCK();
+  if (tag >= 0 && callback) {
+    callback(tag, bytes);
+  }
+#else
+  UNLOCK();
+#endif
+}
+
+/*
+ * This is the state for lifetime classes. "lifetime_anchors" holds the most
+ * recent block of each class, which is forgotten when that block is freed.
+ * Sites are hashed by return address into "lifetime_sites", where a positive
+ * score means long-lived. Samples are hashed by address into
+ * "lifetime_samples". "lifetime_regions" holds one plus the class of the
+ * blocks in each region, or 0 for a region that hasn't held any. A region
+ * only changes class when it's entirely free, so that's enough to keep the
+ * classes apart. Time is measured by "lifetime_clock", which counts
+ * allocations with an unknown lifetime. "free" only looks at any of this
+ * once "lifetime_active" says a lifetime class has been used.
+ */
+static int lifetime_active;
+static void *lifetime_anchors[2];
+static uint8_t lifetime_regions[(size_t)1 << (MAX_ALLOC_LOG2 - BUDDY_LIFETIME_REGION_LOG2)];
+static struct {
+  void *site;
+  int score;
+} lifetime_sites[LIFETIME_SITES];
+static struct {
+  void *ptr;
+  void *site;
+  size_t birth;
+} lifetime_samples[LIFETIME_SAMPLES];
+static size_t lifetime_sample_count;
+static size_t lifetime_clock;
+
+static size_t lifetime_site_slot(void *site) {
+  return ((uintptr_t)site >> 2) % LIFETIME_SITES;
+}
+
+static size_t lifetime_sample_slot(void *ptr) {
+  return ((uintptr_t)ptr >> MIN_ALLOC_LOG2) % LIFETIME_SAMPLES;
+}
+
+/*
+ * Count a sampled block that was born at "birth" toward its site's class.
+ * A site that hashes to a slot owned by another site takes the slot over.
+ */
+static void lifetime_vote(void *site, size_t birth) {
+  size_t slot = lifetime_site_slot(site);
+  int is_long = lifetime_clock - birth >= (size_t)1 << BUDDY_LIFETIME_LONG_LOG2;
+
+  if (lifetime_sites[slot].site != site) {
+    lifetime_sites[slot].site = site;
+    lifetime_sites[slot].score = 0;
+  }
+  if (is_long && lifetime_sites[slot].score < LIFETIME_SCORE_MAX) {
+    lifetime_sites[slot].score++;
+  } else if (!is_long && lifetime_sites[slot].score > -LIFETIME_SCORE_MAX) {
+    lifetime_sites[slot].score--;
+  }
+}
+
+/*
+ * Forget a block that's being freed if it's an anchor, and finish its
+ * sample if it's being sampled.
+ */
+static void lifetime_release(void *ptr) {
+  size_t slot;
+
+  if (ptr == lifetime_anchors[BUDDY_LIFETIME_SHORT]) {
+    lifetime_anchors[BUDDY_LIFETIME_SHORT] = NULL;
+  }
+  if (ptr == lifetime_anchors[BUDDY_LIFETIME_LONG]) {
+    lifetime_anchors[BUDDY_LIFETIME_LONG] = NULL;
+  }
+  if (lifetime_sample_count) {
+    slot = lifetime_sample_slot(ptr);
+    if (lifetime_samples[slot].ptr == ptr) {
+      lifetime_vote(lifetime_samples[slot].site, lifetime_samples[slot].birth);
+      lifetime_samples[slot].ptr = NULL;
+      lifetime_sample_count--;
+    }
+  }
+}
+
+static void release(void *ptr) {
+  size_t bucket;
+#if BUDDY_TAGS
+  int tag;
+#endif
+
+  /*
+   * Ignore any attempts to free a NULL pointer.
+   */
+  if (!ptr) {
+    return;
+  }
+
+  /*
+   * We were given the address returned by "malloc" so get back to the actual
+   * address of the block using the block header. Then release the block for
+   * the bucket that the size in the header maps to.
+   */
+  if (lifetime_active) {
+    lifetime_release(ptr);
+  }
+#if BUDDY_THREADS
+  current_cache = cache_for_payload(ptr);
+#endif
+#if BUDDY_TAGS
+  tag = tag_for_payload(ptr);
+#endif
+  ptr = block_for_payload(ptr, &bucket);
+#if BUDDY_TAGS
+  tag_refund(tag, bucket);
+#endif
+#if BUDDY_RSS_LIMITS
+  rss_in_use -= (size_t)1 << (MAX_ALLOC_LOG2 - bucket);
+#endif
+#if BUDDY_GC
+  gc_clear(gc_blocks, gc_bit_for_block((uint8_t *)ptr));
+#endif
+  free_block((uint8_t *)ptr, bucket);
+#if BUDDY_MERGE_STEPS
+  merge_parked(config.merge_steps);
+#endif
+}
+
+/*
+ * Sort pointers by address. Batches are small, so this is a Shell sort with
+ * Ciura's gap sequence.
+ */
+static void sort_pointers(void **ptrs, size_t count) {
+  static const size_t gaps[] = { 701, 301, 132, 57, 23, 10, 4, 1 };
+  size_t g, gap, i, j;
+
+  for (g = 0; g < sizeof(gaps) / sizeof(*gaps); g++) {
+    gap = gaps[g];
+    for (i = gap; i < count; i++) {
+      void *ptr = ptrs[i];
+      for (j = i; j >= gap && (uintptr_t)ptrs[j - gap] > (uintptr_t)ptr; j -= gap) {
+        ptrs[j] = ptrs[j - gap];
+      }
+      ptrs[j] = ptr;
+    }
+  }
+}
+
+/*
+ * Free every block queued in a deferred buffer in address order, and return
+ * how many there were. This must be called with the lock held.
+ */
+static size_t drain_ring(defer_ring_t *ring) {
+  size_t tail = ring->tail, head = LOAD_ACQUIRE(ring->head), count, i;
+
+  for (count = 0; tail + count != head; count++) {
+    defer_batch[count] = ring->ptrs[(tail + count) % DEFER_SIZE];
+  }
+  STORE_RELEASE(ring->tail, head);
+
+  sort_pointers(defer_batch, count);
+  for (i = 0; i < count; i++) {
+    release(defer_batch[i]);
+  }
+  return count;
+}
+
+/*
+ * Free the blocks in every deferred buffer and return how many there were.
+ * This must be called with the lock held.
+ */
+static size_t drain_deferred(void) {
+#if BUDDY_THREADS
+  thread_cache_t *cache = current_cache;
+  size_t slot, count = 0;
+  for (slot = 0; slot < NO_OWNER; slot++) {
+    count += drain_ring(&thread_caches[slot].deferred);
+  }
+  current_cache = cache;
+  return count;
+#else
+  return drain_ring(&deferred);
+#endif
+}
+
+#if BUDDY_THREADS
+/*
+ * This is the background thread that empties the deferred buffers.
+ */
+static void *reclaim(void *arg) {
+  struct timespec deadline;
+
+  (void)arg;
+  for (;;) {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += RECLAIM_INTERVAL_NS;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&reclaimer_lock);
+    pthread_cond_timedwait(&reclaimer_wake, &reclaimer_lock, &deadline);
+    pthread_mutex_unlock(&reclaimer_lock);
+
+    LOCK();
+    drain_deferred();
+    UNLOCK();
+  }
+  return NULL;
+}
+
+static void start_reclaimer(void) {
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, reclaim, NULL) == 0) {
+    pthread_detach(thread);
+  }
+}
+#endif
+
+#if BUDDY_RSS_LIMITS
+/*
+ * The start of the free block that contains the last byte of the heap, if
+ * the current purge has found one, and the number of bytes released so far.
+ */
+static uint8_t *purge_top;
+static size_t purge_bytes;
+
+/*
+ * Release the whole pages of a free block that lie inside the heap. With
+ * free lists, the list entry at the start of the block has to stay.
+ */
+static void purge_block(uint8_t *ptr, size_t bucket) {
+  uint8_t *end = ptr + ((size_t)1 << (MAX_ALLOC_LOG2 - bucket));
+  uintptr_t start;
+
+#if BUDDY_ENGINE == ENGINE_LISTS
+  ptr += FREE_ENTRY_SIZE;
+#endif
+  if (ptr >= max_ptr) {
+    return;
+  }
+#if BUDDY_ENGINE != ENGINE_MAX_FREE
+  /*
+   * The break can be past the end of the tree, and that memory is free too.
+   */
+  if (end == base_ptr + ((size_t)1 << (MAX_ALLOC_LOG2 - bucket_limit))) {
+    purge_top = ptr;
+  }
+#endif
+  if (end >= max_ptr) {
+    purge_top = ptr;
+    end = max_ptr;
+  }
+  start = ((uintptr_t)ptr + PURGE_PAGE_SIZE - 1) & ~(uintptr_t)(PURGE_PAGE_SIZE - 1);
+  end = (uint8_t *)((uintptr_t)end & ~(uintptr_t)(PURGE_PAGE_SIZE - 1));
+  if ((uint8_t *)start < end && madvise((void *)start, end - (uint8_t *)start, MADV_DONTNEED) == 0) {
+    purge_bytes += end - (uint8_t *)start;
+  }
+}
+
+#if BUDDY_ENGINE == ENGINE_MAX_FREE
+/*
+ * Purge every entirely free node in the subtree rooted at node "i" (which is
+ * in bucket "depth") that's at least a page in size.
+ */
+static void purge_subtree(size_t i, size_t depth) {
+  if (!node_max_free[i] || ptr_for_node(i, depth) >= max_ptr) {
+    return;
+  }
+  if (node_max_free[i] == BUCKET_COUNT - depth) {
+    purge_block(ptr_for_node(i, depth), depth);
+  } else if (depth < PURGE_BUCKET) {
+    purge_subtree(i * 2 + 1, depth + 1);
+    purge_subtree(i * 2 + 2, depth + 1);
+  }
+}
+#endif
+
+/*
+ * Give back as much free memory to the kernel as possible and return how
+ * many bytes that released.
+ */
+static size_t purge_heap(void) {
+  size_t bucket;
+
+  if (!base_ptr) {
+    return 0;
+  }
+  drain_deferred();
+#if BUDDY_MERGE_STEPS
+  while (merge_parked(SIZE_MAX)) {
+  }
+#endif
+  purge_top = NULL;
+  purge_bytes = 0;
+
+#if BUDDY_ENGINE == ENGINE_MAX_FREE
+  (void)bucket;
+  purge_subtree(0, 0);
+#else
+  for (bucket = bucket_limit; bucket <= PURGE_BUCKET; bucket++) {
+#if BUDDY_ENGINE == ENGINE_LISTS
+    list_t *list = free_list(bucket), *entry;
+    for (entry = list->next; entry != list; entry = entry->next) {
+      purge_block((uint8_t *)entry, bucket);
+    }
+#else
+    /*
+     * Only the bits for blocks that start inside the heap need to be looked
+     * at. Bits are node indices plus one, so they start at "2^bucket".
+     */
+    size_t start = (size_t)1 << bucket;
+    size_t end = start + ((size_t)(max_ptr - base_ptr) >> (MAX_ALLOC_LOG2 - bucket)) + 1;
+    size_t bit;
+    if (end > start * 2) {
+      end = start * 2;
+    }
+    for (bit = start; bit < end; bit = (bit | 63) + 1) {
+      uint64_t word = free_bitmap[bit / 64] >> (bit % 64);
+      size_t base = bit;
+      while (word) {
+        size_t found = base + count_trailing_zeros(word);
+        if (found >= end) {
+          break;
+        }
+        purge_block(ptr_for_node(found - 1, bucket), bucket);
+        word &= word - 1;
+      }
+    }
+#endif
+  }
+#endif
+
+  /*
+   * If the end of the heap is free, move the break back to the first page
+   * boundary after the start of that free block. Memory past the break is
+   * assumed to be zero when it's reserved again, so the rest of that page is
+   * cleared first.
+   */
+  if (purge_top) {
+    uint8_t *top = (uint8_t *)(((uintptr_t)purge_top + PURGE_PAGE_SIZE - 1) &
+      ~(uintptr_t)(PURGE_PAGE_SIZE - 1));
+    if (top < max_ptr) {
+      memset(purge_top, 0, top - purge_top);
+      if (move_break(top)) {
+        max_ptr = top;
+      }
+    }
+  }
+
+  rss_estimate = rss_in_use;
+  STAT(stats.purges++);
+  STAT(stats.purged_bytes += purge_bytes);
+  return purge_bytes;
+}
+
+/*
+ * Read a small file from "/proc" or "/sys" into "buffer" and null-terminate
+ * it. This doesn't use stdio since that allocates memory.
+ */
+static int read_system_file(const char *path, char *buffer, size_t size) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  ssize_t length;
+
+  if (fd < 0) {
+    return 0;
+  }
+  length = read(fd, buffer, size - 1);
+  close(fd);
+  if (length <= 0) {
+    return 0;
+  }
+  buffer[length] = '\0';
+  return 1;
+}
+
+/*
+ * Return the number of bytes of the whole process that are resident, or
+ * SIZE_MAX if that's unknown.
+ */
+static size_t process_rss(void) {
+  char buffer[128], *text = buffer;
+  size_t pages = 0;
+
+  if (!read_system_file("/proc/self/statm", buffer, sizeof(buffer))) {
+    return SIZE_MAX;
+  }
+  while (*text && *text != ' ') text++;
+  while (*text == ' ') text++;
+  for (; *text >= '0' && *text <= '9'; text++) {
+    pages = pages * 10 + (*text - '0');
+  }
+  return pages * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+#if BUDDY_CGROUP_POLL_LOG2
+/*
+ * Return the number after "key " at the start of a line in "text", or after
+ * the start of the text if "key" is empty, or 0 if there isn't one.
+ */
+static unsigned long long cgroup_value(const char *text, const char *key) {
+  size_t length = strlen(key);
+  unsigned long long value = 0;
+
+  while (length && text && (strncmp(text, key, length) || text[length] != ' ')) {
+    text = strchr(text, '\n');
+    if (text) text++;
+  }
+  if (!text) {
+    return 0;
+  }
+  for (text += length ? length + 1 : 0; *text >= '0' && *text <= '9'; text++) {
+    value = value * 10 + (*text - '0');
+  }
+  return value;
+}
+
+/*
+ * Return true if the cgroup has hit its "high" or "max" limit since the last
+ * poll or is getting close to "max".
+ */
+static int cgroup_under_pressure(void) {
+  static unsigned long long last_events;
+  unsigned long long events, current, limit;
+  char buffer[512];
+  int result = 0;
+
+  if (read_system_file("/sys/fs/cgroup/memory.events", buffer, sizeof(buffer))) {
+    events = cgroup_value(buffer, "high") + cgroup_value(buffer, "max");
+    result = events != last_events;
+    last_events = events;
+  }
+  if (read_system_file("/sys/fs/cgroup/memory.max", buffer, sizeof(buffer)) &&
+      (limit = cgroup_value(buffer, "")) != 0 &&
+      read_system_file("/sys/fs/cgroup/memory.current", buffer, sizeof(buffer))) {
+    current = cgroup_value(buffer, "");
+    result |= current > limit - limit / 8;
+  }
+  return result;
+}
+#endif
+
+/*
+ * Return true if handing out "size" more bytes calls for a purge. That's
+ * when it goes over the soft limit with enough free memory that may still
+ * be resident, or over the hard limit with any at all.
+ */
+static int rss_should_purge(size_t size) {
+  return (config.rss_soft_limit && rss_estimate + size > config.rss_soft_limit &&
+      rss_estimate >= rss_in_use + config.rss_soft_limit / 16) ||
+    (config.rss_hard_limit && rss_estimate + size > config.rss_hard_limit &&
+      rss_estimate > rss_in_use);
+}
+
+/*
+ * Decide whether a block from this bucket may be handed out, purging first
+ * if that's needed to stay under the limits. A purge only happens if the
+ * estimate still calls for one after it has been refreshed.
+ */
+static int rss_admit(size_t bucket) {
+  size_t size = (size_t)1 << (MAX_ALLOC_LOG2 - bucket);
+#if BUDDY_CGROUP_POLL_LOG2
+  static size_t polls;
+
+  if (++polls % ((size_t)1 << BUDDY_CGROUP_POLL_LOG2) == 0 && cgroup_under_pressure()) {
+    purge_heap();
+  }
+#endif
+  if (rss_should_purge(size)) {
+    size_t rss = process_rss();
+    if (rss < rss_estimate) {
+      rss_estimate = rss;
+    }
+    if (rss_should_purge(size)) {
+      purge_heap();
+    }
+  }
+  return !config.rss_hard_limit || rss_estimate + size <= config.rss_hard_limit;
+}
+
+/*
+ * After an allocation of "request" bytes failed, run the pressure callback
+ * (without the lock held) and return true if the allocation should be tried
+ * again.
+ */
+static int relieve_pressure(size_t request) {
+  void (*callback)(size_t size);
+  LOCK();
+  callback = pressure_callback;
+  UNLOCK();
+  if (!callback) {
+    return 0;
+  }
+  callback(request);
+  return 1;
+}
+#endif
+
+#if BUDDY_FIXED_HEAP_LOG2
+/*
+ * Reserve the whole fixed heap and fault in every page of it. "mlock" does
+ * that and also keeps the pages from being swapped out. If it isn't allowed,
+ * every page is written to instead.
+ */
+static void reserve_heap(void) {
+  uint8_t *end = base_ptr + FIXED_HEAP_SIZE, *page;
+
+  if (!move_break(end)) {
+    return;
+  }
+  max_ptr = end;
+  if (mlock(base_ptr, FIXED_HEAP_SIZE) != 0) {
+    for (page = base_ptr; page < end; page += FIXED_PAGE_SIZE) {
+      *(volatile uint8_t *)page = 0;
+    }
+  }
+}
+#endif
+
+/*
+ * Return the option called "name", which is "length" characters long and
+ * doesn't need to be terminated, or NULL if there is no such option.
+ */
+static const option_t *find_option(const char *name, size_t length) {
+  size_t i;
+  for (i = 0; i < sizeof(options) / sizeof(*options); i++) {
+    if (strlen(options[i].name) == length && !memcmp(options[i].name, name, length)) {
+      return &options[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Apply the "BUDDY_MALLOC_CONF" environment variable once. Values are
+ * decimal numbers with an optional "k", "m" or "g" suffix. This runs before
+ * the heap exists, so it must not allocate memory.
+ */
+static void load_config(void) {
+  static int loaded;
+  const char *text;
+
+  if (loaded) {
+    return;
+  }
+  loaded = 1;
+
+  for (text = getenv("BUDDY_MALLOC_CONF"); text && *text; ) {
+    const char *name = text;
+    const option_t *option;
+    size_t value = 0, shift = 0;
+    int valid = 0;
+
+    while (*text && *text != ':' && *text != ',') {
+      text++;
+    }
+    option = find_option(name, text - name);
+
+    if (*text == ':') {
+      for (text++; *text >= '0' && *text <= '9'; text++) {
+        valid = valid >= 0 && value <= (SIZE_MAX - 9) / 10 ? 1 : -1;
+        value = value * 10 + (*text - '0');
+      }
+      if (*text == 'k') shift = 10;
+      else if (*text == 'm') shift = 20;
+      else if (*text == 'g') shift = 30;
+      if (shift) {
+        text++;
+        if (value > SIZE_MAX >> shift) valid = -1;
+        value <<= shift;
+      }
+    }
+
+    if (option && valid > 0 && (*text == ',' || !*text) &&
+        value >= option->min && value <= option->max) {
+      *option->value = value;
+    }
+    while (*text && *text != ',') {
+      text++;
+    }
+    if (*text == ',') {
+      text++;
+    }
+  }
+}
+
+/*
+ * Set up the heap. At the beginning, the tree has a single node that
+ * represents the smallest possible allocation size. More memory will be
+ * reserved later as needed.
+ */
+static void initialize(void) {
+#if BUDDY_ENGINE == ENGINE_BITMAPS
+  size_t level, offset = 0, bits = (size_t)1 << BUCKET_COUNT;
+#endif
+
+  load_config();
+  max_ptr = (uint8_t *)sbrk(0);
+  base_ptr = max_ptr + (BASE_ALIGNMENT - (uintptr_t)max_ptr % BASE_ALIGNMENT) % BASE_ALIGNMENT;
+  buddy_heap_base = (char *)base_ptr;
+#if BUDDY_FIXED_HEAP_LOG2
+  reserve_heap();
+#endif
+#if BUDDY_ENGINE == ENGINE_MAX_FREE
+  node_max_free[0] = BUCKET_COUNT;
+#else
+#if BUDDY_ENGINE == ENGINE_BITMAPS
+  for (level = 0; level < FREE_BITMAP_LEVELS; level++) {
+    free_bitmap_level[level] = offset;
+    bits = (bits + 63) / 64;
+    offset += bits;
+  }
+#endif
+#if BUDDY_THREADS
+  /*
+   * Start with a tree of a single cache line so that the tree never grows
+   * through the per-thread buckets.
+   */
+  bucket_limit = LINE_BUCKET;
+#else
+  bucket_limit = BUCKET_COUNT - 1;
+#endif
+  update_max_ptr(base_ptr + FREE_ENTRY_SIZE);
+  free_init(bucket_limit);
+  free_push(bucket_limit, base_ptr);
+#if BUDDY_MERGE_STEPS && BUDDY_ENGINE == ENGINE_LISTS
+  {
+    size_t bucket;
+    for (bucket = 0; bucket < BUCKET_COUNT; bucket++) {
+      list_init(&parked[bucket]);
+    }
+  }
+#endif
+#endif
+
+#if BUDDY_FIXED_HEAP_LOG2
+  /*
+   * Grow the tree to the size of the heap right away. The max-free engine's
+   * tree always spans the whole address range, so the part after the heap
+   * is marked as used instead.
+   */
+#if BUDDY_ENGINE == ENGINE_MAX_FREE
+  {
+    size_t bucket, index = node_for_ptr(base_ptr, FIXED_BUCKET);
+    for (bucket = FIXED_BUCKET; bucket > 0; bucket--) {
+      node_max_free[node_for_ptr(base_ptr, bucket) + 1] = 0;
+    }
+    node_max_free[index] = BUCKET_COUNT - FIXED_BUCKET;
+    max_free_update_parents(index, FIXED_BUCKET);
+  }
+#else
+  lower_bucket_limit(FIXED_BUCKET);
+#endif
+#endif
+}
+
+/*
+ * Also set up the heap before "main" runs, so that "buddy_heap_base" is
+ * already final when the program first looks at it. Compilers assume that
+ * "malloc" doesn't change global variables, so a value read before the first
+ * allocation could otherwise be reused after it.
+ */
+#if defined(__GNUC__)
+__attribute__((constructor)) static void initialize_early(void) {
+  if (base_ptr == NULL) {
+    initialize();
+  }
+#if BUDDY_THREADS
+  pthread_atfork(fork_prepare, fork_parent, fork_child);
+#endif
+}
+#endif
+
+static void *allocate(size_t request) {
+  size_t bucket;
+  uint8_t *ptr;
+
+  /*
+   * Make sure it's possible for an allocation of this size to succeed. There's
+   * a hard-coded limit on the maximum allocation size because of the way this
+   * allocator works. This is written so that it can't overflow, which matters
+   * for 32-bit targets where sizes near SIZE_MAX are easy to compute by
+   * accident.
+   */
+  if (request > MAX_ALLOC - HEADER_SIZE) {
+    return NULL;
+  }
+
+  /*
+   * Initialize our global state if this is the first call to "malloc".
+   */
+  if (base_ptr == NULL) {
+    initialize();
+  }
+
+  /*
+   * Find the smallest bucket that will fit this request and try to allocate
+   * a block from it.
+   */
+  bucket = bucket_for_request(request + HEADER_SIZE);
+#if BUDDY_THREADS
+  if (bucket > LINE_BUCKET && current_cache == &thread_caches[NO_OWNER]) {
+    bucket = LINE_BUCKET;
+  }
+#endif
+#if BUDDY_MERGE_STEPS
+  /*
+   * Continue merging blocks that "free" left parked. If there's no free
+   * block large enough for this request, finish merging all of them instead,
+   * since the alternative is growing the heap.
+   */
+  if (merge_parked(config.merge_steps) && !free_available(bucket)) {
+    merge_parked(SIZE_MAX);
+  }
+#endif
+  STAT(stats.buckets[bucket].mallocs++);
+#if BUDDY_TAGS
+  if (!tag_admit(bucket)) {
+    STAT(stats.buckets[bucket].failures++);
+    return NULL;
+  }
+#endif
+#if BUDDY_RSS_LIMITS
+  if (!rss_admit(bucket)) {
+    STAT(stats.buckets[bucket].failures++);
+    return NULL;
+  }
+#endif
+  ptr = alloc_block(bucket);
+  if (!ptr && drain_deferred()) {
+    ptr = alloc_block(bucket);
+  }
+  if (!ptr) {
+    STAT(stats.buckets[bucket].failures++);
+    return NULL;
+  }
+
+  /*
+   * Now that we have a memory address, write the block header (just the size
+   * of the allocation) and return the address immediately after the header.
+   */
+  return payload_for_block(ptr, bucket, request);
+}
+
+/*
+ * Allocate a block as close as possible to the block holding "hint", but only
+ * inside the aligned block of 2^"window_log2" bytes that contains it. If
+ * there's no room there, this is just "allocate".
+ */
+static void *allocate_within(void *hint, size_t request, size_t window_log2) {
+  size_t bucket, hint_bucket, i;
+  uint8_t *ptr;
+
+  if (!hint || request > MAX_ALLOC - HEADER_SIZE) {
+    return allocate(request);
+  }
+
+  /*
+   * Find the node for the block containing the hint and the bucket for the
+   * new allocation.
+   */
+  ptr = block_for_payload(hint, &hint_bucket);
+  bucket = bucket_for_request(request + HEADER_SIZE);
+#if BUDDY_THREADS
+  /*
+   * Small free blocks next to the hint are on the lists of the thread that
+   * owns the hint's cache line. Unless that's us, start from the line.
+   */
+  if (bucket > LINE_BUCKET && current_cache == &thread_caches[NO_OWNER]) {
+    return allocate(request);
+  }
+  if (hint_bucket > LINE_BUCKET && cache_for_payload(hint) != current_cache) {
+    hint_bucket = LINE_BUCKET;
+  }
+#endif
+  i = node_for_ptr(ptr, hint_bucket);
+#if BUDDY_TAGS
+  if (!tag_admit(bucket)) {
+    return allocate(request);
+  }
+#endif
+#if BUDDY_RSS_LIMITS
+  if (!rss_admit(bucket)) {
+    return allocate(request);
+  }
+#endif
+
+#if BUDDY_ENGINE == ENGINE_MAX_FREE
+  /*
+   * Walk up from the hint and allocate from the first enclosing subtree that
+   * has a large enough free block.
+   */
+  while (i != 0 && MAX_ALLOC_LOG2 - hint_bucket < window_log2) {
+    i = (i - 1) / 2;
+    hint_bucket--;
+    if (hint_bucket <= bucket) {
+      ptr = max_free_alloc(i, hint_bucket, bucket, 0);
+      if (ptr) {
+        STAT(stats.buckets[bucket].mallocs++);
+        return payload_for_block(ptr, bucket, request);
+      }
+    }
+  }
+#else
+  /*
+   * Walk up from the hint toward the root. Every node on this path is USED
+   * because it contains the hint, so whenever the parent is SPLIT, the buddy
+   * of the node must be UNUSED. That buddy is the closest free block at that
+   * level, so use it as soon as it's large enough.
+   */
+  while (hint_bucket > bucket_limit &&
+      MAX_ALLOC_LOG2 - hint_bucket < window_log2) {
+    size_t buddy = ((i - 1) ^ 1) + 1;
+
+    if (hint_bucket <= bucket && parent_is_split(i)) {
+      size_t size = (size_t)1 << (MAX_ALLOC_LOG2 - hint_bucket);
+      int rightmost = buddy < i;
+      uint8_t *block = ptr_for_node(buddy, hint_bucket);
+
+      /*
+       * Use the end of the buddy that's closest to the hint. If that's the
+       * right end, the whole block has to be reserved. Otherwise only the
+       * part up to the first free list entry is needed, just like "malloc".
+       */
+      size_t bytes_needed = (size_t)1 << (MAX_ALLOC_LOG2 - bucket);
+      if (rightmost) {
+        bytes_needed = size;
+      } else if (hint_bucket < bucket && size / 2 + FREE_ENTRY_SIZE > bytes_needed) {
+        bytes_needed = size / 2 + FREE_ENTRY_SIZE;
+      }
+      if (!update_max_ptr(block + bytes_needed)) {
+        break;
+      }
+
+      free_remove(hint_bucket, block);
+      ptr = split_block(block, hint_bucket, bucket, rightmost);
+      STAT(stats.buckets[bucket].mallocs++);
+      return payload_for_block(ptr, bucket, request);
+    }
+
+    i = (i - 1) / 2;
+    hint_bucket--;
+  }
+#endif
+
+  return allocate(request);
+}
+
+static void *allocate_near(void *hint, size_t request) {
+  return allocate_within(hint, request, config.near_window_log2);
+}
+
+/*
+ * Return the entry of "lifetime_regions" for the region that holds a block
+ * returned by "malloc", or NULL if the block is a whole region or more.
+ */
+static uint8_t *lifetime_region(void *payload) {
+  size_t bucket;
+  uint8_t *ptr = block_for_payload(payload, &bucket);
+
+  if (bucket <= REGION_BUCKET) {
+    return NULL;
+  }
+  return &lifetime_regions[(size_t)(ptr - base_ptr) >> BUDDY_LIFETIME_REGION_LOG2];
+}
+
+/*
+ * Allocate a block of the given lifetime class next to the previous block of
+ * that class. For an unknown lifetime, the class is looked up by call site
+ * and some of the blocks are sampled to learn it.
+ */
+static void *allocate_lifetime(size_t request, int lifetime, void *site) {
+  void *result;
+  uint8_t *region;
+  size_t slot;
+
+  lifetime_active = 1;
+  if (lifetime == BUDDY_LIFETIME_UNKNOWN) {
+    slot = lifetime_site_slot(site);
+    lifetime = lifetime_sites[slot].site == site && lifetime_sites[slot].score > 0 ?
+      BUDDY_LIFETIME_LONG : BUDDY_LIFETIME_SHORT;
+    lifetime_clock++;
+  } else {
+    site = NULL;
+  }
+  if (lifetime != BUDDY_LIFETIME_LONG) {
+    lifetime = BUDDY_LIFETIME_SHORT;
+  }
+
+  result = allocate_within(lifetime_anchors[lifetime], request, BUDDY_LIFETIME_REGION_LOG2);
+  region = result ? lifetime_region(result) : NULL;
+
+  /*
+   * If there was no room near the anchor and the block that was found
+   * instead is in a region of the other class, put it back and start a new
+   * region.
+   */
+  if (region && *region == 2 - lifetime) {
+#if BUDDY_THREADS
+    thread_cache_t *cache = current_cache;
+    release(result);
+    current_cache = cache;
+#else
+    release(result);
+#endif
+    lifetime_end = lifetime == BUDDY_LIFETIME_SHORT;
+    result = allocate(request);
+    lifetime_end = -1;
+    region = result ? lifetime_region(result) : NULL;
+  }
+  if (!result) {
+    return NULL;
+  }
+  if (region && *region != 2 - lifetime) {
+    *region = (uint8_t)(lifetime + 1);
+  }
+  lifetime_anchors[lifetime] = result;
+
+  /*
+   * Sample this block. If the slot is taken by a block that has already
+   * lived long enough to count as long-lived, that vote isn't lost.
+   */
+  if (site && lifetime_clock % ((size_t)1 << BUDDY_LIFETIME_SAMPLE_LOG2) == 0) {
+    slot = lifetime_sample_slot(result);
+    if (!lifetime_samples[slot].ptr) {
+      lifetime_sample_count++;
+    } else if (lifetime_clock - lifetime_samples[slot].birth >= (size_t)1 << BUDDY_LIFETIME_LONG_LOG2) {
+      lifetime_vote(lifetime_samples[slot].site, lifetime_samples[slot].birth);
+    }
+    lifetime_samples[slot].ptr = result;
+    lifetime_samples[slot].site = site;
+    lifetime_samples[slot].birth = lifetime_clock;
+  }
+  return result;
+}
+
+/*
+ * Return the size that was requested for a block returned by "malloc".
+ */
+static size_t request_for_payload(void *payload) {
+  size_t header = *(size_t *)((uint8_t *)payload - HEADER_SIZE);
+#if BUDDY_THREADS
+  if (header & OWNER_FLAG) {
+    return header & (CACHE_LINE_SIZE - 1);
+  }
+#endif
+  return HEADER_REQUEST(header);
+}
+
+/*
+ * Try to change the size of a block without moving it. This works as long as
+ * the new size still maps to the same bucket and, with cache coloring, still
+ * gives the block the same color.
+ */
+static int resize_in_place(void *payload, size_t request) {
+  size_t bucket, *header = (size_t *)((uint8_t *)payload - HEADER_SIZE);
+  uint8_t *ptr = block_for_payload(payload, &bucket);
+
+  if (bucket_for_request(request + HEADER_SIZE) != bucket) {
+    return 0;
+  }
+#if BUDDY_CACHE_COLORING
+  if (ptr + color_offset(ptr, bucket, request) != (uint8_t *)header) {
+    return 0;
+  }
+#endif
+
+#if BUDDY_THREADS
+  if (*header & OWNER_FLAG) {
+    *header = (*header & ~(CACHE_LINE_SIZE - 1)) | request;
+    return 1;
+  }
+#endif
+  request |= *header & TAG_MASK;
+  *header = request;
+  *(size_t *)ptr = request;
+  return 1;
+}
+
+#if STREAM_KERNELS
+/*
+ * Copy or clear "n" bytes with non-temporal stores. The destination must be
+ * aligned to a cache line and "n" must be a multiple of a cache line. The
+ * caller issues the fence that orders these stores with later ones.
+ */
+static void stream_copy_sse2(uint8_t *dst, const uint8_t *src, size_t n) {
+  for (; n; n -= 64, dst += 64, src += 64) {
+    __m128i a = _mm_loadu_si128((const __m128i *)src);
+    __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+    __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+    __m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+    _mm_stream_si128((__m128i *)dst, a);
+    _mm_stream_si128((__m128i *)(dst + 16), b);
+    _mm_stream_si128((__m128i *)(dst + 32), c);
+    _mm_stream_si128((__m128i *)(dst + 48), d);
+  }
+}
+
+static void stream_zero_sse2(uint8_t *dst, size_t n) {
+  __m128i zero = _mm_setzero_si128();
+  for (; n; n -= 64, dst += 64) {
+    _mm_stream_si128((__m128i *)dst, zero);
+    _mm_stream_si128((__m128i *)(dst + 16), zero);
+    _mm_stream_si128((__m128i *)(dst + 32), zero);
+    _mm_stream_si128((__m128i *)(dst + 48), zero);
+  }
+}
+
+__attribute__((target("avx2")))
+static void stream_copy_avx2(uint8_t *dst, const uint8_t *src, size_t n) {
+  for (; n; n -= 64, dst += 64, src += 64) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)src);
+    __m256i b = _mm256_loadu_si256((const __m256i *)(src + 32));
+    _mm256_stream_si256((__m256i *)dst, a);
+    _mm256_stream_si256((__m256i *)(dst + 32), b);
+  }
+}
+
+__attribute__((target("avx2")))
+static void stream_zero_avx2(uint8_t *dst, size_t n) {
+  __m256i zero = _mm256_setzero_si256();
+  for (; n; n -= 64, dst += 64) {
+    _mm256_stream_si256((__m256i *)dst, zero);
+    _mm256_stream_si256((__m256i *)(dst + 32), zero);
+  }
+}
+
+/*
+ * Return true if the CPU supports AVX2. This may run before constructors
+ * (the first "malloc" often does), so the CPU model is initialized here.
+ */
+static int cpu_has_avx2(void) {
+  static int result = -1;
+  if (result < 0) {
+    __builtin_cpu_init();
+    result = __builtin_cpu_supports("avx2") ? 1 : 0;
+  }
+  return result;
+}
+#endif
+
+/*
+ * Copy between two blocks that don't overlap. Large copies stream the middle
+ * part that covers whole cache lines of the destination.
+ */
+static void bulk_copy(uint8_t *dst, const uint8_t *src, size_t n) {
+#if STREAM_KERNELS
+  if (n >= (size_t)1 << LOAD_ACQUIRE(config.stream_min_log2)) {
+    size_t head = -(uintptr_t)dst & (CACHE_LINE_SIZE - 1);
+    size_t body = (n - head) & ~(CACHE_LINE_SIZE - 1);
+    memcpy(dst, src, head);
+    if (cpu_has_avx2()) {
+      stream_copy_avx2(dst + head, src + head, body);
+    } else {
+      stream_copy_sse2(dst + head, src + head, body);
+    }
+    _mm_sfence();
+    memcpy(dst + head + body, src + head + body, n - head - body);
+    return;
+  }
+#endif
+  memcpy(dst, src, n);
+}
+
+static void bulk_zero(uint8_t *dst, size_t n) {
+#if STREAM_KERNELS
+  if (n >= (size_t)1 << LOAD_ACQUIRE(config.stream_min_log2)) {
+    size_t head = -(uintptr_t)dst & (CACHE_LINE_SIZE - 1);
+    size_t body = (n - head) & ~(CACHE_LINE_SIZE - 1);
+    memset(dst, 0, head);
+    if (cpu_has_avx2()) {
+      stream_zero_avx2(dst + head, body);
+    } else {
+      stream_zero_sse2(dst + head, body);
+    }
+    _mm_sfence();
+    memset(dst + head + body, 0, n - head - body);
+    return;
+  }
+#endif
+  memset(dst, 0, n);
+}
+
+#if REMAP_BLOCKS
+/*
+ * Move the first "n" bytes of the payload "src" to the newly-allocated
+ * payload "dst" by moving pages instead of copying them. Both blocks must be
+ * whole pages and both payloads must start at the same offset in their
+ * blocks, since any other page in the range belongs to a neighboring block.
+ * The old pages are replaced with zero pages so the heap never
+ * has holes ("MREMAP_DONTUNMAP" needs Linux 5.7). This returns 0 if the
+ * pages weren't moved.
+ */
+static int remap_payload(uint8_t *dst, uint8_t *src, size_t n) {
+  size_t dst_bucket, src_bucket, length, dst_header, src_header;
+  uint8_t *dst_block, *src_block;
+
+  if (n < (size_t)1 << LOAD_ACQUIRE(config.remap_min_log2)) {
+    return 0;
+  }
+
+  dst_block = block_for_payload(dst, &dst_bucket);
+  src_block = block_for_payload(src, &src_bucket);
+  if (dst - dst_block != src - src_block ||
+      MAX_ALLOC_LOG2 - dst_bucket < REMAP_PAGE_LOG2 ||
+      MAX_ALLOC_LOG2 - src_bucket < REMAP_PAGE_LOG2 ||
+      (uintptr_t)dst_block % REMAP_PAGE_SIZE != 0 ||
+      (uintptr_t)src_block % REMAP_PAGE_SIZE != 0) {
+    return 0;
+  }
+
+  dst_header = *(size_t *)(dst - HEADER_SIZE);
+  src_header = *(size_t *)(src - HEADER_SIZE);
+  length = (size_t)(src - src_block) + n;
+  length = (length + REMAP_PAGE_SIZE - 1) & ~(REMAP_PAGE_SIZE - 1);
+  if (mremap(src_block, length, length, MREMAP_MAYMOVE | MREMAP_FIXED |
+      MREMAP_DONTUNMAP, dst_block) == MAP_FAILED) {
+    return 0;
+  }
+
+  /*
+   * The pages came with the headers of the old block and left zeros behind,
+   * so write back the headers of both blocks. The old one is still needed to
+   * free it.
+   */
+  *(size_t *)dst_block = dst_header;
+  *(size_t *)(dst - HEADER_SIZE) = dst_header;
+  *(size_t *)src_block = src_header;
+  *(size_t *)(src - HEADER_SIZE) = src_header;
+  return 1;
+}
+#endif
+
+/*
+ * The state of a call to "buddy_iterate". Only blocks whose returned address
+ * lies between "start" and "end" are reported.
+ */
+typedef struct iterate_t {
+  uintptr_t start, end;
+  void (*callback)(void *ptr, size_t size, void *arg);
+  void *arg;
+  size_t count;
+} iterate_t;
+
+#if FREE_TAGS
+/*
+ * A free list entry can't say which list it's on, and the entry at the start
+ * of a block may belong to a free block further down the left edge of the
+ * block. So while "buddy_iterate" runs, the "prev" link of every entry holds
+ * FREE_TAG(bucket) instead, which can't be mistaken for a header. The links
+ * are put back afterward by walking each list forward.
+ */
+#define FREE_TAG(bucket) ((list_t *)~(uintptr_t)(bucket))
+
+static void tag_list(list_t *list, size_t bucket, int tag) {
+  list_t *entry, *prev = list;
+  for (entry = list->next; entry != list; entry = entry->next) {
+    entry->prev = tag ? FREE_TAG(bucket) : prev;
+    prev = entry;
+  }
+}
+
+/*
+ * Tag (or untag) the entries on every free list.
+ */
+static void tag_free_lists(int tag) {
+  size_t bucket;
+#if BUDDY_THREADS
+  size_t slot;
+  for (slot = 0; slot < NO_OWNER; slot++) {
+    list_t *lists = thread_caches[slot].buckets;
+    if (lists[0].next) {
+      for (bucket = LINE_BUCKET + 1; bucket < BUCKET_COUNT; bucket++) {
+        tag_list(&lists[bucket - LINE_BUCKET - 1], bucket, tag);
+      }
+    }
+  }
+  for (bucket = bucket_limit; bucket <= LINE_BUCKET; bucket++) {
+#else
+  for (bucket = bucket_limit; bucket < BUCKET_COUNT; bucket++) {
+#endif
+    tag_list(&buckets[bucket], bucket, tag);
+#if BUDDY_MERGE_STEPS
+    tag_list(&parked[bucket], bucket, tag);
+#endif
+  }
+}
+#endif
+
+#if BUDDY_ENGINE != ENGINE_MAX_FREE
+/*
+ * Return true if the block for this node is on the free list for its bucket.
+ * The block must be reserved memory. Without "-DBUDDY_FREE_INDEX=1", the
+ * free lists must be tagged.
+ */
+static int node_is_free(size_t index, size_t bucket) {
+#if BUDDY_ENGINE == ENGINE_BITMAPS
+  (void)bucket;
+  return (free_bitmap[(index + 1) / 64] >> ((index + 1) % 64)) & 1;
+#elif FREE_INDEX
+  (void)bucket;
+  return (node_is_free_bits[index / 64] >> (index % 64)) & 1;
+#else
+  return ((list_t *)ptr_for_node(index, bucket))->prev == FREE_TAG(bucket);
+#endif
+}
+
+/*
+ * Return true if no node on the path from this node down its left edge to
+ * the smallest bucket is SPLIT or has a free left child. In that case the
+ * start of the block is the start of a used block, so it holds a header.
+ */
+static int left_edge_is_used(size_t index, size_t bucket) {
+  for (; bucket < BUCKET_COUNT - 1; bucket++) {
+    index = index * 2 + 1;
+    if (parent_is_split(index) || node_is_free(index, bucket + 1)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+#endif
+
+/*
+ * Return the address that was returned to the caller for the used block at
+ * "ptr" in this bucket. This is like "payload_for_block" without the writes.
+ */
+static uint8_t *payload_for_used_block(uint8_t *ptr, size_t bucket) {
+#if BUDDY_CACHE_COLORING
+  ptr += color_offset(ptr, bucket, HEADER_REQUEST(*(size_t *)ptr));
+#else
+  (void)bucket;
+#endif
+  return ptr + HEADER_SIZE;
+}
+
+/*
+ * Report the block at "ptr" in this bucket to the callback if its returned
+ * address is in range.
+ */
+static void iterate_report(iterate_t *state, uint8_t *ptr, size_t bucket) {
+  ptr = payload_for_used_block(ptr, bucket);
+  if ((uintptr_t)ptr >= state->start && (uintptr_t)ptr < state->end) {
+    state->callback(ptr, request_for_payload(ptr), state->arg);
+    state->count++;
+  }
+}
+
+/*
+ * Visit the subtree under a node that isn't free and report every used block
+ * in it. Whole subtrees that are free or outside the range are skipped. The
+ * recursion is at most BUCKET_COUNT deep.
+ *
+ * This can't scan the split bits a word at a time and skip the zero words.
+ * A clear bit only says that both children are in the same state, which is
+ * just as true of a node whose children are both used as of one whose
+ * children are both free. A zero word is as likely to be a densely used
+ * part of the heap as an empty one. The free subtrees that the bits can
+ * identify are already skipped here one node at a time, wherever they are.
+ *
+ * A block that was handed out looks just like a node whose children are both
+ * used, so the header at the start of the block is what tells them apart. It
+ * can only be trusted if the start of the block is known to be used memory,
+ * which is what "is_used" says ("left_edge_is_used" works it out otherwise).
+ */
+static void iterate_node(iterate_t *state, size_t index, size_t bucket, int is_used) {
+  uint8_t *ptr = ptr_for_node(index, bucket);
+  size_t size = (size_t)1 << (MAX_ALLOC_LOG2 - bucket);
+  size_t left = index * 2 + 1, header_bucket;
+
+  if ((uintptr_t)ptr + size <= state->start || (uintptr_t)ptr >= state->end) {
+    return;
+  }
+
+#if BUDDY_ENGINE == ENGINE_MAX_FREE
+  /*
+   * Nodes past the end of the heap can only be the ones that a fixed heap
+   * marks as used.
+   */
+  if (ptr >= max_ptr) {
+    return;
+  }
+
+  /*
+   * A node with no free space below it starts with a used block. Otherwise
+   * it must have been split, so its children are up to date.
+   */
+  (void)is_used;
+  if (node_max_free[index] == 0) {
+    block_for_payload(ptr + HEADER_SIZE, &header_bucket);
+    if (header_bucket == bucket || bucket == BUCKET_COUNT - 1) {
+      iterate_report(state, ptr, bucket);
+      return;
+    }
+  }
+  if (node_max_free[left] != BUCKET_COUNT - bucket - 1) {
+    iterate_node(state, left, bucket + 1, 0);
+  }
+  if (node_max_free[left + 1] != BUCKET_COUNT - bucket - 1) {
+    iterate_node(state, left + 1, bucket + 1, 0);
+  }
+#else
+  if (bucket == BUCKET_COUNT - 1) {
+    iterate_report(state, ptr, bucket);
+    return;
+  }
+
+  /*
+   * If this node is SPLIT, exactly one child is free so only the other one
+   * needs to be visited.
+   */
+  if (parent_is_split(left)) {
+    if (node_is_free(left, bucket + 1)) {
+      iterate_node(state, left + 1, bucket + 1, 0);
+    } else {
+      iterate_node(state, left, bucket + 1, 0);
+    }
+    return;
+  }
+
+  /*
+   * Otherwise either both children are free (which only happens to blocks
+   * carved by a refill), or this is a block that was handed out, or both
+   * children are used.
+   */
+  if (node_is_free(left, bucket + 1)) {
+    return;
+  }
+  if (is_used || left_edge_is_used(index, bucket)) {
+    block_for_payload(ptr + HEADER_SIZE, &header_bucket);
+    if (header_bucket == bucket) {
+      iterate_report(state, ptr, bucket);
+      return;
+    }
+    iterate_node(state, left, bucket + 1, 1);
+  } else {
+    iterate_node(state, left, bucket + 1, 0);
+  }
+  iterate_node(state, left + 1, bucket + 1, 0);
+#endif
+}
+
+/*
+ * Return the address (as returned by "malloc") of the live allocation that
+ * contains "target", or NULL if there isn't one. This follows the same steps
+ * as "iterate_node" but only descends into the child that contains "target",
+ * so it visits one node per level. Without "-DBUDDY_FREE_INDEX=1", the free
+ * lists must be tagged.
+ */
+static uint8_t *find_payload(uint8_t *target) {
+  size_t index, bucket, header_bucket;
+  uint8_t *ptr;
+  int is_used = 0;
+
+  if (!base_ptr || target < base_ptr || target >= max_ptr) {
+    return NULL;
+  }
+
+#if BUDDY_ENGINE == ENGINE_MAX_FREE
+  (void)is_used;
+  index = 0;
+  bucket = 0;
+  if (node_max_free[index] == BUCKET_COUNT) {
+    return NULL;
+  }
+#else
+  bucket = bucket_limit;
+  index = node_for_ptr(base_ptr, bucket);
+  if ((size_t)(target - base_ptr) >> (MAX_ALLOC_LOG2 - bucket) || node_is_free(index, bucket)) {
+    return NULL;
+  }
+#endif
+
+  for (;; bucket++) {
+    size_t left = index * 2 + 1;
+    ptr = ptr_for_node(index, bucket);
+    if (bucket == BUCKET_COUNT - 1) {
+      break;
+    }
+
+#if BUDDY_ENGINE == ENGINE_MAX_FREE
+    (void)left;
+    if (node_max_free[index] == 0) {
+      block_for_payload(ptr + HEADER_SIZE, &header_bucket);
+      if (header_bucket == bucket) {
+        break;
+      }
+    }
+    index = node_for_ptr(target, bucket + 1);
+    if (node_max_free[index] == BUCKET_COUNT - bucket - 1) {
+      return NULL;
+    }
+#else
+    if (parent_is_split(left)) {
+      index = node_for_ptr(target, bucket + 1);
+      if (node_is_free(index, bucket + 1)) {
+        return NULL;
+      }
+      is_used = 0;
+      continue;
+    }
+    if (node_is_free(left, bucket + 1)) {
+      return NULL;
+    }
+    if (is_used || left_edge_is_used(index, bucket)) {
+      block_for_payload(ptr + HEADER_SIZE, &header_bucket);
+      if (header_bucket == bucket) {
+        break;
+      }
+      is_used = 1;
+    }
+    index = node_for_ptr(target, bucket + 1);
+    is_used = is_used && index == left;
+#endif
+  }
+
+  /*
+   * The block has been found. The pointer must also be inside the part that
+   * was requested, not in the header or in unused space at the end.
+   */
+  ptr = payload_for_used_block(ptr, bucket);
+  if (target < ptr || (target != ptr && (size_t)(target - ptr) >= request_for_payload(ptr))) {
+    return NULL;
+  }
+  return ptr;
+}
+
+/*
+ * Report every used block in the heap. Without "-DBUDDY_FREE_INDEX=1", the
+ * free lists must be tagged.
+ */
+static void iterate_heap(iterate_t *state) {
+  size_t root = 0, bucket = 0;
+
+  if (!base_ptr) {
+    return;
+  }
+#if BUDDY_ENGINE == ENGINE_MAX_FREE
+  if (node_max_free[root] != BUCKET_COUNT) {
+    iterate_node(state, root, bucket, 0);
+  }
+#else
+  bucket = bucket_limit;
+  root = node_for_ptr(base_ptr, bucket);
+  if (!node_is_free(root, bucket)) {
+    iterate_node(state, root, bucket, 0);
+  }
+#endif
+}
+
+#if BUDDY_GC
+/*
+ * Return the address (as returned by "malloc") of the used block whose bit in
+ * the collector's bitmaps is "bit".
+ */
+static uint8_t *gc_payload_for_bit(size_t bit) {
+  uint8_t *ptr = base_ptr + ((size_t)bit << MIN_ALLOC_LOG2);
+  size_t bucket;
+  block_for_payload(ptr + HEADER_SIZE, &bucket);
+  return payload_for_used_block(ptr, bucket);
+}
+
+/*
+ * Treat every aligned word from "start" to "end" as a possible pointer. Each
+ * unmarked collectable block that one of them points into is marked and
+ * pushed so its contents get scanned too. Looking up a word that isn't a
+ * pointer into the heap costs two comparisons, and looking up one that is
+ * descends the tree like "buddy_find_block".
+ */
+static void gc_mark_range(uint8_t *start, uint8_t *end) {
+  uint8_t **word = (uint8_t **)(((uintptr_t)start + sizeof(void *) - 1) & ~(uintptr_t)(sizeof(void *) - 1));
+  uint8_t *payload;
+  size_t bucket, bit;
+
+  for (; (uint8_t *)(word + 1) <= end; word++) {
+    if (*word < base_ptr || *word >= max_ptr || !(payload = find_payload(*word))) {
+      continue;
+    }
+    bit = gc_bit_for_block(block_for_payload(payload, &bucket));
+    if (!gc_test(gc_blocks, bit) || gc_test(gc_marks, bit)) {
+      continue;
+    }
+    gc_set(gc_marks, bit);
+    if (gc_stack_top < GC_STACK_SIZE) {
+      gc_stack[gc_stack_top++] = payload;
+    } else {
+      gc_stack_overflow = 1;
+    }
+  }
+}
+
+/*
+ * Scan the contents of every block on the mark stack until it's empty.
+ */
+static void gc_drain(void) {
+  while (gc_stack_top) {
+    uint8_t *payload = gc_stack[--gc_stack_top];
+    gc_mark_range(payload, payload + request_for_payload(payload));
+  }
+}
+
+/*
+ * Scan the data and bss segments. The allocator's own arrays are skipped:
+ * they're large, and the mark stack would otherwise keep everything on it
+ * alive.
+ */
+static void gc_mark_data(void) {
+  uint8_t *skip[][2] = {
+#if BUDDY_ENGINE == ENGINE_MAX_FREE
+    { node_max_free, node_max_free + sizeof(node_max_free) },
+#else
+    { node_is_split, node_is_split + sizeof(node_is_split) },
+#endif
+#if BUDDY_ENGINE == ENGINE_BITMAPS
+    { (uint8_t *)free_bitmap, (uint8_t *)free_bitmap + sizeof(free_bitmap) },
+#endif
+#if FREE_INDEX
+    { (uint8_t *)node_is_free_bits, (uint8_t *)node_is_free_bits + sizeof(node_is_free_bits) },
+#endif
+    { (uint8_t *)gc_blocks, (uint8_t *)gc_blocks + sizeof(gc_blocks) },
+    { (uint8_t *)gc_marks, (uint8_t *)gc_marks + sizeof(gc_marks) },
+    { (uint8_t *)gc_stack, (uint8_t *)gc_stack + sizeof(gc_stack) },
+  };
+  size_t count = sizeof(skip) / sizeof(*skip), i;
+  uint8_t *ptr = (uint8_t *)__data_start, *next;
+
+  while (ptr < (uint8_t *)_end) {
+    next = (uint8_t *)_end;
+    for (i = 0; i < count; i++) {
+      if (skip[i][0] <= ptr && ptr < skip[i][1]) {
+        next = ptr = skip[i][1];
+        break;
+      }
+      if (skip[i][0] > ptr && skip[i][0] < next) {
+        next = skip[i][0];
+      }
+    }
+    if (i == count) {
+      gc_mark_range(ptr, next);
+      gc_drain();
+      ptr = next;
+    }
+  }
+}
+
+/*
+ * Scan a live block that isn't collectable. This is an "iterate_heap"
+ * callback.
+ */
+static void gc_mark_block(void *ptr, size_t size, void *arg) {
+  size_t bucket;
+  (void)arg;
+  if (!gc_test(gc_blocks, gc_bit_for_block(block_for_payload(ptr, &bucket)))) {
+    gc_mark_range((uint8_t *)ptr, (uint8_t *)ptr + size);
+    gc_drain();
+  }
+}
+
+/*
+ * Mark every collectable block that's reachable from the roots. Without
+ * "-DBUDDY_FREE_INDEX=1", the free lists must be tagged.
+ */
+static void gc_mark(void) {
+  jmp_buf registers;
+  iterate_t state;
+  size_t words, i;
+  uint64_t bits;
+
+  /*
+   * Spill the registers onto the stack so they're scanned with it.
+   */
+  setjmp(registers);
+
+  gc_stack_overflow = 0;
+  gc_mark_range((uint8_t *)&registers, (uint8_t *)__libc_stack_end);
+  gc_drain();
+  gc_mark_data();
+  state.start = 0;
+  state.end = UINTPTR_MAX;
+  state.callback = gc_mark_block;
+  state.arg = NULL;
+  state.count = 0;
+  iterate_heap(&state);
+
+  words = (((size_t)(max_ptr - base_ptr) >> MIN_ALLOC_LOG2) + 63) / 64;
+  while (gc_stack_overflow) {
+    gc_stack_overflow = 0;
+    for (i = 0; i < words; i++) {
+      for (bits = gc_marks[i]; bits; bits &= bits - 1) {
+        uint8_t *payload = gc_payload_for_bit(i * 64 + count_trailing_zeros(bits));
+        gc_mark_range(payload, payload + request_for_payload(payload));
+        gc_drain();
+      }
+    }
+  }
+}
+
+/*
+ * Mark everything reachable from the roots, then free the collectable blocks
+ * that weren't marked and return how many there were.
+ *
+ * The sweep walks the bitmaps one 64-bit word at a time in address order, so
+ * runs of live blocks cost almost nothing and dead blocks are freed from low
+ * to high addresses. Each one is merged with its buddy right away if that's
+ * free, which lets a run of dead neighbors collapse into large blocks as it
+ * goes.
+ */
+static size_t collect(void) {
+  size_t words, i, freed = 0;
+  uint64_t bits;
+
+  if (!base_ptr) {
+    return 0;
+  }
+
+#if FREE_TAGS
+  tag_free_lists(1);
+#endif
+  gc_mark();
+#if FREE_TAGS
+  tag_free_lists(0);
+#endif
+
+  words = (((size_t)(max_ptr - base_ptr) >> MIN_ALLOC_LOG2) + 63) / 64;
+  for (i = 0; i < words; i++) {
+    bits = gc_blocks[i] & ~gc_marks[i];
+    gc_marks[i] = 0;
+    for (; bits; bits &= bits - 1) {
+      release(gc_payload_for_bit(i * 64 + count_trailing_zeros(bits)));
+      freed++;
+    }
+  }
+  return freed;
+}
+#endif
+
+/*
+ * Memory allocated through a handle can be moved by "buddy_compact" while it
+ * isn't pinned. Handles are indices into a table of these entries, plus one
+ * so that 0 can mean failure. Unused entries have a NULL pointer and are
+ * chained together through "pins", which holds the next unused handle.
+ */
+typedef struct {
+  uint8_t *ptr;
+  size_t pins;
+} handle_t;
+
+static handle_t *handles;
+static size_t handle_count;
+static size_t handle_capacity;
+static size_t free_handle;
+
+/*
+ * This is where the last call to "buddy_compact" stopped, so that the next
+ * call picks up from there.
+ */
+static size_t compact_cursor;
+
+/*
+ * Return a handle for a new entry pointing at "ptr", or 0 if the table can't
+ * grow. The table itself is an ordinary block that is never moved except
+ * when it grows.
+ */
+static size_t handle_create(uint8_t *ptr) {
+  size_t handle = free_handle;
+
+  if (handle) {
+    free_handle = handles[handle - 1].pins;
+  } else {
+    if (handle_count == handle_capacity) {
+      size_t capacity = handle_capacity ? handle_capacity * 2 : 64;
+      handle_t *table = (handle_t *)allocate(capacity * sizeof(handle_t));
+      if (!table) {
+        return 0;
+      }
+      if (handles) {
+        memcpy(table, handles, handle_count * sizeof(handle_t));
+        release(handles);
+      }
+      handles = table;
+      handle_capacity = capacity;
+    }
+    handle = ++handle_count;
+  }
+
+  handles[handle - 1].ptr = ptr;
+  handles[handle - 1].pins = 0;
+  return handle;
+}
+
+/*
+ * Return the entry for a handle, or NULL if it isn't in use.
+ */
+static handle_t *handle_entry(size_t handle) {
+  if (!handle || handle > handle_count || !handles[handle - 1].ptr) {
+    return NULL;
+  }
+  return &handles[handle - 1];
+}
+
+/*
+ * Return true if the buddy of the used block at this node is entirely free.
+ * Then this block is the only thing keeping its parent from merging. With
+ * split bits, the parent's bit is the exclusive-or of whether the children
+ * are free, so for a used block it says exactly that.
+ */
+static int buddy_is_free(size_t index, size_t bucket) {
+#if BUDDY_ENGINE == ENGINE_MAX_FREE
+  return index != 0 && node_max_free[((index - 1) ^ 1) + 1] == BUCKET_COUNT - bucket;
+#else
+  return bucket != bucket_limit && parent_is_split(index);
+#endif
+}
+
+/*
+ * Try to move the block behind a handle so that its old spot can merge with
+ * its buddy. It's only moved if its buddy is free and the new block's buddy
+ * isn't, otherwise the move wouldn't reduce fragmentation. Allocation would
+ * pick the same spot again, so "*stuck" collects the buckets where that
+ * happened and they're skipped for the rest of the pass. This returns the
+ * number of bytes copied.
+ */
+static size_t compact_handle(handle_t *entry, uint32_t *stuck) {
+  size_t bucket, new_bucket, request, index;
+  uint8_t *block, *ptr;
+
+  block = block_for_payload(entry->ptr, &bucket);
+  index = node_for_ptr(block, bucket);
+  if (entry->pins || (*stuck >> bucket) & 1 || !buddy_is_free(index, bucket)) {
+    return 0;
+  }
+#if BUDDY_THREADS
+  /*
+   * Blocks smaller than a cache line belong to the lines of the thread that
+   * allocated them, so they stay where they are.
+   */
+  if (bucket > LINE_BUCKET) {
+    return 0;
+  }
+#endif
+
+  /*
+   * The free buddy itself is often the first block allocation finds. If so,
+   * hold on to it while asking for another one.
+   */
+  request = request_for_payload(entry->ptr);
+#if BUDDY_TAGS
+  pending_tag = tag_for_payload(entry->ptr);
+#endif
+  ptr = (uint8_t *)allocate(request);
+  if (ptr) {
+    block = block_for_payload(ptr, &new_bucket);
+    if (node_for_ptr(block, new_bucket) == ((index - 1) ^ 1) + 1) {
+      uint8_t *spare = ptr;
+      ptr = (uint8_t *)allocate(request);
+      release(spare);
+    }
+  }
+#if BUDDY_TAGS
+  pending_tag = -1;
+#endif
+  if (!ptr) {
+    *stuck |= (uint32_t)1 << bucket;
+    return 0;
+  }
+  block = block_for_payload(ptr, &new_bucket);
+  if (buddy_is_free(node_for_ptr(block, new_bucket), new_bucket)) {
+    release(ptr);
+    *stuck |= (uint32_t)1 << bucket;
+    return 0;
+  }
+
+  memcpy(ptr, entry->ptr, request);
+  release(entry->ptr);
+  entry->ptr = ptr;
+  return request;
+}
+
+/*
+ * These are the public entry points. In thread-safe mode they serialize all
+ * calls with the lock.
+ */
+void *malloc(size_t request) {
+  void *result;
+  lock_for_thread();
+#if BUDDY_LIFETIME_AUTO
+  result = allocate_lifetime(request, BUDDY_LIFETIME_UNKNOWN, __builtin_return_address(0));
+#else
+  result = allocate(request);
+#endif
+  unlock_for_thread();
+#if BUDDY_RSS_LIMITS
+  if (!result && relieve_pressure(request)) {
+    lock_for_thread();
+    result = allocate(request);
+    unlock_for_thread();
+  }
+#endif
+  return result;
+}
+
+void free(void *ptr) {
+  LOCK();
+  release(ptr);
+  UNLOCK();
+}
+
+void free_deferred(void *ptr) {
+  defer_ring_t *ring;
+  size_t head;
+
+  if (!ptr) {
+    return;
+  }
+#if BUDDY_THREADS
+  {
+    thread_cache_t *cache = cache_for_thread();
+    if (cache == &thread_caches[NO_OWNER]) {
+      free(ptr);
+      return;
+    }
+    ring = &cache->deferred;
+  }
+  pthread_once(&reclaimer_once, start_reclaimer);
+#else
+  ring = &deferred;
+#endif
+
+  /*
+   * If the buffer is full, empty it here instead of waiting.
+   */
+  head = ring->head;
+  if (head - LOAD_ACQUIRE(ring->tail) == DEFER_SIZE) {
+    LOCK();
+    drain_ring(ring);
+    UNLOCK();
+  }
+  ring->ptrs[head % DEFER_SIZE] = ptr;
+  STORE_RELEASE(ring->head, head + 1);
+
+#if BUDDY_THREADS
+  if (head + 1 - LOAD_ACQUIRE(ring->tail) == DEFER_SIZE / 2) {
+    pthread_cond_signal(&reclaimer_wake);
+  }
+#endif
+}
+
+void buddy_flush_deferred(void) {
+  LOCK();
+  drain_deferred();
+  UNLOCK();
+}
+
+void *malloc_near(void *hint, size_t request) {
+  void *result;
+  lock_for_thread();
+  result = allocate_near(hint, request);
+  unlock_for_thread();
+  return result;
+}
+
+void *malloc_lifetime(size_t request, int lifetime) {
+  void *result;
+  lock_for_thread();
+  result = allocate_lifetime(request, lifetime, __builtin_return_address(0));
+  unlock_for_thread();
+  return result;
+}
+
+void *malloc_tagged(size_t request, int tag) {
+#if BUDDY_TAGS
+  void *result;
+  if (tag < 0 || tag >= BUDDY_TAGS) {
+    return NULL;
+  }
+  lock_for_thread();
+  pending_tag = tag;
+  result = allocate(request);
+  pending_tag = -1;
+  unlock_for_thread();
+  return result;
+#else
+  (void)tag;
+  return malloc(request);
+#endif
+}
+
+void buddy_set_thread_tag(int tag) {
+#if BUDDY_TAGS
+  if (tag < 0 || tag >= BUDDY_TAGS) {
+    return;
+  }
+  thread_tag = tag;
+#else
+  (void)tag;
+#endif
+}
+
+size_t buddy_tag_usage(int tag) {
+#if BUDDY_TAGS
+  size_t result;
+  if (tag < 0 || tag >= BUDDY_TAGS) {
+    return 0;
+  }
+  LOCK();
+  result = tag_bytes[tag];
+  UNLOCK();
+  return result;
+#else
+  (void)tag;
+  return 0;
+#endif
+}
+
+void buddy_set_tag_quota(int tag, size_t soft, size_t hard) {
+#if BUDDY_TAGS
+  if (tag < 0 || tag >= BUDDY_TAGS) {
+    return;
+  }
+  LOCK();
+  tag_soft_quota[tag] = soft;
+  tag_hard_quota[tag] = hard;
+  UNLOCK();
+#else
+  (void)tag;
+  (void)soft;
+  (void)hard;
+#endif
+}
+
+void buddy_set_quota_callback(void (*callback)(int tag, size_t bytes)) {
+#if BUDDY_TAGS
+  LOCK();
+  tag_callback = callback;
+  UNLOCK();
+#else
+  (void)callback;
+#endif
+}
+
+/*
+ * Allocate a block and clear the part of it that might not be zero already.
+ */
+static void *allocate_zeroed(size_t request) {
+  size_t bucket;
+  uint8_t *result, *ptr, *clean;
+
+  lock_for_thread();
+  clean = max_ptr;
+  result = (uint8_t *)allocate(request);
+  unlock_for_thread();
+  if (!result) {
+    return NULL;
+  }
+
+  /*
+   * Memory at or above the end of the heap before this call has never been
+   * written to, so it's still zero from the kernel. The only exception is
+   * the free list entry at the start of the block, which may have been
+   * written while growing the tree. So only the rest needs to be cleared.
+   */
+  ptr = block_for_payload(result, &bucket);
+  if (!clean || clean > result + request) {
+    clean = result + request;
+  } else if (clean < ptr + FREE_ENTRY_SIZE) {
+    clean = ptr + FREE_ENTRY_SIZE;
+  }
+  if (clean > result) {
+    bulk_zero(result, clean - result);
+  }
+  return result;
+}
+
+void *calloc(size_t count, size_t size) {
+  size_t request = count * size;
+  void *result;
+
+  if (size && request / size != count) {
+    return NULL;
+  }
+  result = allocate_zeroed(request);
+#if BUDDY_RSS_LIMITS
+  if (!result && relieve_pressure(request)) {
+    result = allocate_zeroed(request);
+  }
+#endif
+  return result;
+}
+
+void *realloc(void *ptr, size_t request) {
+  size_t old_request;
+  uint8_t *result;
+
+  if (!ptr) {
+    return malloc(request);
+  }
+  if (!request) {
+    free(ptr);
+    return NULL;
+  }
+
+  /*
+   * Keep the block if the new size still fits. Otherwise allocate a new one
+   * and move the contents over outside of the lock.
+   */
+  lock_for_thread();
+  if (request <= MAX_ALLOC - HEADER_SIZE && resize_in_place(ptr, request)) {
+    unlock_for_thread();
+    return ptr;
+  }
+#if BUDDY_TAGS
+  pending_tag = tag_for_payload(ptr);
+#endif
+  result = (uint8_t *)allocate(request);
+#if BUDDY_TAGS
+  pending_tag = -1;
+#endif
+#if BUDDY_GC
+  {
+    size_t bucket;
+    if (result && gc_test(gc_blocks, gc_bit_for_block(block_for_payload(ptr, &bucket)))) {
+      gc_set(gc_blocks, gc_bit_for_block(block_for_payload(result, &bucket)));
+    }
+  }
+#endif
+  unlock_for_thread();
+  if (!result) {
+    return NULL;
+  }
+
+  old_request = request_for_payload(ptr);
+  if (old_request > request) {
+    old_request = request;
+  }
+#if REMAP_BLOCKS
+  if (!remap_payload(result, (uint8_t *)ptr, old_request)) {
+    bulk_copy(result, (const uint8_t *)ptr, old_request);
+  }
+#else
+  bulk_copy(result, (const uint8_t *)ptr, old_request);
+#endif
+
+  /*
+   * This doesn't call "free" because the compiler knows what "free" means and
+   * may drop the stores to the old block's header that "remap_payload" just
+   * made, since they look dead.
+   */
+  LOCK();
+  release(ptr);
+  UNLOCK();
+  return result;
+}
+
+size_t buddy_iterate(void *base, size_t size,
+    void (*callback)(void *ptr, size_t size, void *arg), void *arg) {
+  iterate_t state;
+
+  state.start = (uintptr_t)base;
+  state.end = size > UINTPTR_MAX - state.start ? UINTPTR_MAX : state.start + size;
+  state.callback = callback;
+  state.arg = arg;
+  state.count = 0;
+
+  LOCK();
+#if FREE_TAGS
+  if (base_ptr) {
+    tag_free_lists(1);
+  }
+#endif
+  iterate_heap(&state);
+#if FREE_TAGS
+  if (base_ptr) {
+    tag_free_lists(0);
+  }
+#endif
+  UNLOCK();
+
+  return state.count;
+}
+
+int buddy_find_block(const void *ptr, void **start, size_t *size) {
+  uint8_t *payload;
+
+  LOCK();
+#if FREE_TAGS
+  if (base_ptr) {
+    tag_free_lists(1);
+  }
+#endif
+  payload = find_payload((uint8_t *)ptr);
+#if FREE_TAGS
+  if (base_ptr) {
+    tag_free_lists(0);
+  }
+#endif
+  if (payload) {
+    *start = payload;
+    *size = request_for_payload(payload);
+  }
+  UNLOCK();
+
+  return payload != NULL;
+}
+
+void *buddy_gc_malloc(size_t request) {
+  uint8_t *result = (uint8_t *)allocate_zeroed(request);
+#if BUDDY_GC
+  size_t bucket;
+  if (result) {
+    gc_set(gc_blocks, gc_bit_for_block(block_for_payload(result, &bucket)));
+  }
+#endif
+  return result;
+}
+
+size_t buddy_gc_collect(void) {
+#if BUDDY_GC
+  size_t freed;
+#if BUDDY_STATS
+  struct timespec before, after;
+  clock_gettime(CLOCK_MONOTONIC, &before);
+#endif
+  freed = collect();
+#if BUDDY_STATS
+  clock_gettime(CLOCK_MONOTONIC, &after);
+  STAT(stats.gc_collections++);
+  STAT(stats.gc_blocks_freed += freed);
+  STAT(stats.gc_nanoseconds += (after.tv_sec - before.tv_sec) * 1000000000ULL +
+    after.tv_nsec - before.tv_nsec);
+#endif
+  return freed;
+#else
+  return 0;
+#endif
+}
+
+uint32_t buddy_malloc32(size_t request) {
+  return buddy_offset32(malloc(request));
+}
+
+void buddy_free32(uint32_t offset) {
+  free(buddy_ptr32(offset));
+}
+
+size_t buddy_halloc(size_t request) {
+  uint8_t *ptr;
+  size_t handle = 0;
+
+  lock_for_thread();
+  ptr = (uint8_t *)allocate(request);
+  if (ptr) {
+    handle = handle_create(ptr);
+    if (!handle) {
+      release(ptr);
+    }
+  }
+  unlock_for_thread();
+
+  return handle;
+}
+
+void *buddy_hpin(size_t handle) {
+  handle_t *entry;
+  void *result = NULL;
+
+  LOCK();
+  entry = handle_entry(handle);
+  if (entry) {
+    entry->pins++;
+    result = entry->ptr;
+  }
+  UNLOCK();
+
+  return result;
+}
+
+void buddy_hunpin(size_t handle) {
+  handle_t *entry;
+
+  LOCK();
+  entry = handle_entry(handle);
+  if (entry && entry->pins) {
+    entry->pins--;
+  }
+  UNLOCK();
+}
+
+void buddy_hfree(size_t handle) {
+  handle_t *entry;
+
+  LOCK();
+  entry = handle_entry(handle);
+  if (entry) {
+    release(entry->ptr);
+    entry->ptr = NULL;
+    entry->pins = free_handle;
+    free_handle = handle;
+  }
+  UNLOCK();
+}
+
+size_t buddy_compact(size_t budget) {
+  size_t moved = 0, visited;
+  uint32_t stuck = 0;
+
+  lock_for_thread();
+  for (visited = 0; visited < handle_count && moved < budget; visited++) {
+    if (compact_cursor >= handle_count) {
+      compact_cursor = 0;
+    }
+    if (handles[compact_cursor].ptr) {
+      moved += compact_handle(&handles[compact_cursor], &stuck);
+    }
+    compact_cursor++;
+  }
+  unlock_for_thread();
+
+  return moved;
+}
+
+int buddy_tick(void) {
+  int result = 0;
+  LOCK();
+  drain_deferred();
+#if BUDDY_MERGE_STEPS
+  result = merge_parked(config.merge_steps);
+#endif
+  UNLOCK();
+  return result;
+}
+
+void buddy_set_rss_limits(size_t soft, size_t hard) {
+#if BUDDY_RSS_LIMITS
+  LOCK();
+  config.rss_soft_limit = soft;
+  config.rss_hard_limit = hard;
+  UNLOCK();
+#else
+  (void)soft;
+  (void)hard;
+#endif
+}
+
+void buddy_set_pressure_callback(void (*callback)(size_t size)) {
+#if BUDDY_RSS_LIMITS
+  LOCK();
+  pressure_callback = callback;
+  UNLOCK();
+#else
+  (void)callback;
+#endif
+}
+
+size_t buddy_purge(void) {
+#if BUDDY_RSS_LIMITS
+  size_t result;
+  lock_for_thread();
+  result = purge_heap();
+  UNLOCK();
+  return result;
+#else
+  return 0;
+#endif
+}
+
+int buddy_get_stats(struct buddy_stats *result) {
+  size_t bucket;
+
+#if BUDDY_STATS
+  LOCK();
+  *result = stats;
+  UNLOCK();
+#else
+  memset(result, 0, sizeof(*result));
+#endif
+
+  result->bucket_count = BUCKET_COUNT;
+  for (bucket = 0; bucket < BUCKET_COUNT; bucket++) {
+    result->buckets[bucket].block_size = (size_t)1 << (MAX_ALLOC_LOG2 - bucket);
+  }
+
+  return BUDDY_STATS;
+}
+
+int buddy_ctl(const char *name, size_t *old_value, const size_t *new_value) {
+  const option_t *option = find_option(name, strlen(name));
+  int result = -1;
+
+  LOCK();
+  load_config();
+  if (option && (!new_value ||
+      (*new_value >= option->min && *new_value <= option->max))) {
+    if (old_value) {
+      *old_value = *option->value;
+    }
+    if (new_value) {
+      STORE_RELEASE(*option->value, *new_value);
+    }
+    result = 0;
+  }
+  UNLOCK();
+
+  return result;
 }
@@ -0,0 +1,312 @@
+/*
+ * This header declares the parts of the buddy allocator that go beyond the
+ * standard "malloc" and "free" functions. None of it is needed to use the
+ * allocator as a plain "malloc" replacement.
+ */
+
+#ifndef BUDDY_MALLOC_H
+#define BUDDY_MALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Allocate memory close to the allocation "hint" (a pointer returned by one of
+ * the allocation functions). This looks for a free block next to the block
+ * containing the hint, moving outward up to a fixed distance, and behaves like
+ * "malloc" if none is found. Use it for nodes of linked data structures to
+ * keep related nodes on the same cache lines and pages.
+ */
+void *malloc_near(void *hint, size_t size);
+
+/*
+ * Allocate memory with a hint about how long it will live. Blocks with the
+ * same hint are placed near each other (like "malloc_near" with the previous
+ * one as the hint), so long-lived blocks don't end up scattered among
+ * short-lived ones where they keep freed memory from merging. With
+ * BUDDY_LIFETIME_UNKNOWN, the lifetime is learned per call site by sampling.
+ */
+#define BUDDY_LIFETIME_SHORT 0
+#define BUDDY_LIFETIME_LONG 1
+#define BUDDY_LIFETIME_UNKNOWN 2
+
+void *malloc_lifetime(size_t size, int lifetime);
+
+/*
+ * With "-DBUDDY_TAGS=N", every allocation is charged to a tag from 0 to N - 1
+ * for memory accounting. "malloc" and the other allocation functions use the
+ * calling thread's tag, which is 0 until "buddy_set_thread_tag" changes it,
+ * and "malloc_tagged" uses the given one ("realloc" keeps the tag of the old
+ * block). It returns NULL for tags out of range. Without that option these
+ * do nothing and "malloc_tagged" is "malloc".
+ */
+void *malloc_tagged(size_t size, int tag);
+void buddy_set_thread_tag(int tag);
+
+/*
+ * Return the number of bytes that live allocations with this tag take up in
+ * the heap. This counts whole blocks, so it's at least the sum of the sizes
+ * that were requested.
+ */
+size_t buddy_tag_usage(int tag);
+
+/*
+ * Limit the bytes a tag can take up. Allocations that would go over "hard"
+ * fail. Going over "soft" calls the quota callback with the tag and its new
+ * usage. A quota of 0 means no limit. The callback runs after the allocator
+ * is unlocked again, so it may allocate and free memory.
+ */
+void buddy_set_tag_quota(int tag, size_t soft, size_t hard);
+void buddy_set_quota_callback(void (*callback)(int tag, size_t bytes));
+
+/*
+ * Free memory later instead of now. This just queues the pointer, so the
+ * caller doesn't pay for the free right away. Queued blocks are freed in
+ * batches in address order, so buddies merge as they go. In thread-safe
+ * mode a background thread does that. Otherwise it only happens when the
+ * queue is full, when an allocation would fail and in "buddy_tick", so call
+ * that now and then. "buddy_flush_deferred" frees everything that is queued
+ * right away. Freeing a batch touches each block again after it has left
+ * the cache, so the total cost is higher than with "free". This only pays
+ * off when the background thread runs on another core.
+ */
+void free_deferred(void *ptr);
+void buddy_flush_deferred(void);
+
+/*
+ * Call "callback" once for every live allocation whose address (as returned by
+ * one of the allocation functions) lies between "base" and "base + size", with
+ * that address and the size that was requested. Pass NULL and SIZE_MAX to see
+ * the whole heap. This walks the allocator's tree and skips free subtrees, so
+ * it takes time proportional to the number of live allocations. With the
+ * default free list engine and without "-DBUDDY_FREE_INDEX=1", it also
+ * visits every free block twice, which dominates in a sparse heap. It returns
+ * the number of allocations reported. In thread-safe mode the callback runs
+ * with the allocator locked, so it must not allocate or free memory.
+ */
+size_t buddy_iterate(void *base, size_t size,
+  void (*callback)(void *ptr, size_t size, void *arg), void *arg);
+
+/*
+ * Find the live allocation that contains "ptr", which may point anywhere
+ * inside it. If there is one, this sets "start" to its address (as returned
+ * by one of the allocation functions) and "size" to the size that was
+ * requested, and returns 1. Otherwise it returns 0. This descends the
+ * allocator's tree toward "ptr", which takes O(log N) time with
+ * "-DBUDDY_ENGINE=1", "-DBUDDY_ENGINE=2" or "-DBUDDY_FREE_INDEX=1". Free
+ * list entries don't say which list they're on, so otherwise it also has to
+ * visit every free block.
+ */
+int buddy_find_block(const void *ptr, void **start, size_t *size);
+
+/*
+ * Allocate zeroed memory that is freed automatically by "buddy_gc_collect"
+ * once nothing points into it anymore. It can also be freed explicitly. This
+ * needs "-DBUDDY_GC=1" and behaves like "calloc(1, size)" otherwise.
+ */
+void *buddy_gc_malloc(size_t size);
+
+/*
+ * Free every block from "buddy_gc_malloc" that can't be reached from the
+ * calling thread's stack and registers, from global variables, or from other
+ * live allocations, and return how many were freed. Reachability is decided
+ * conservatively: any word that points anywhere inside a block keeps it
+ * alive. This returns 0 without "-DBUDDY_GC=1".
+ */
+size_t buddy_gc_collect(void);
+
+/*
+ * The heap is never larger than 2gb, so any address returned by the allocator
+ * fits in 32 bits as an offset from the start of the heap. Storing offsets
+ * instead of pointers halves the size of links in pointer-heavy structures.
+ * Offset 0 is never a valid allocation and stands for NULL.
+ *
+ * "buddy_heap_base" is the start of the heap. With GCC and Clang it's set
+ * before "main" runs. Otherwise it's NULL until the first allocation. It never
+ * changes after that, so the conversions below are safe to inline.
+ */
+extern char *buddy_heap_base;
+
+#if defined(__cplusplus) || (defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L)
+#define BUDDY_INLINE inline
+#elif defined(__GNUC__)
+#define BUDDY_INLINE __inline__
+#else
+#define BUDDY_INLINE
+#endif
+
+static BUDDY_INLINE void *buddy_ptr32(uint32_t offset) {
+  return offset ? buddy_heap_base + offset : NULL;
+}
+
+static BUDDY_INLINE uint32_t buddy_offset32(const void *ptr) {
+  return ptr ? (uint32_t)((const char *)ptr - buddy_heap_base) : 0;
+}
+
+/*
+ * These are "malloc" and "free" for offsets. "buddy_malloc32" returns 0 on
+ * failure. The memory is ordinary memory from the allocator, so
+ * "buddy_free32(buddy_offset32(ptr))" and "free(buddy_ptr32(offset))" work
+ * too.
+ */
+uint32_t buddy_malloc32(size_t size);
+void buddy_free32(uint32_t offset);
+
+/*
+ * Allocate memory that the allocator may move to reduce fragmentation. This
+ * returns a handle, or 0 on failure. "buddy_hpin" returns the current address
+ * of the memory and keeps it there until the matching "buddy_hunpin". Pins
+ * nest. Don't keep the address after unpinning, since the memory may move
+ * then. "buddy_hfree" frees the memory and the handle.
+ */
+size_t buddy_halloc(size_t size);
+void *buddy_hpin(size_t handle);
+void buddy_hunpin(size_t handle);
+void buddy_hfree(size_t handle);
+
+/*
+ * Move unpinned handle memory out of blocks whose buddy is free into holes
+ * next to used blocks, so that the freed buddies can merge into larger
+ * blocks. This stops after copying about "budget" bytes and returns how many
+ * bytes it copied. The next call continues where this one stopped, so
+ * calling it with a small budget now and then compacts the heap gradually.
+ */
+size_t buddy_compact(size_t budget);
+
+/*
+ * Free the blocks queued by "free_deferred", and with "-DBUDDY_MERGE_STEPS=K"
+ * do up to K of the merges that "free" left for later. This returns 1 if
+ * there may be more merges to do and 0 otherwise.
+ */
+int buddy_tick(void);
+
+/*
+ * With "-DBUDDY_RSS_LIMITS=1", keep the memory the heap takes up under
+ * control. Past "soft" bytes, free memory is given back to the kernel once
+ * enough of it has built up. At "hard" bytes, allocations first give back
+ * everything they can, and if that isn't enough, "malloc" and "calloc" call
+ * the pressure callback with the size that was requested (so it can drop
+ * caches, for example) and try once more. A limit of 0 means no limit.
+ * "buddy_purge" gives back all free memory now and returns how many bytes
+ * that was. These do nothing without that option.
+ */
+void buddy_set_rss_limits(size_t soft, size_t hard);
+void buddy_set_pressure_callback(void (*callback)(size_t size));
+size_t buddy_purge(void);
+
+/*
+ * Read and change the options that can be set at runtime, which are the ones
+ * "BUDDY_MALLOC_CONF" accepts (see the README). If "old_value" isn't NULL,
+ * the current value is stored there. If "new_value" isn't NULL, the option
+ * is set to it, which takes effect with the next call into the allocator.
+ * This returns 0 on success and -1 if there's no option with that name (for
+ * example because its feature wasn't compiled in) or the value is out of
+ * range, in which case nothing changes.
+ */
+int buddy_ctl(const char *name, size_t *old_value, const size_t *new_value);
+
+/*
+ * This is an upper bound on the number of buckets in any configuration of
+ * the allocator. Only the first "bucket_count" entries of the per-bucket
+ * statistics are used.
+ */
+#define BUDDY_MAX_BUCKETS 32
+
+/*
+ * Counters for a single bucket (i.e. a single block size). Requests are
+ * counted in the bucket of the smallest block that fits them.
+ */
+struct buddy_bucket_stats {
+  size_t block_size;
+
+  /* The number of calls to "malloc" and how many of them returned NULL. */
+  size_t mallocs;
+  size_t failures;
+
+  /* The number of times the tree grew so that its root has this size. */
+  size_t tree_growths;
+
+  /* The number of times a free block of this size was split. */
+  size_t splits;
+
+  /*
+   * The number of splits where no candidate block with an entirely used
+   * buddy was found, so a block that could still have merged into a larger
+   * block was split instead. This is only counted when the allocator is
+   * compiled with "-DBUDDY_PRESERVE_LARGE=1".
+   */
+  size_t unpreferred_splits;
+};
+
+struct buddy_stats {
+  size_t bucket_count;
+  struct buddy_bucket_stats buckets[BUDDY_MAX_BUCKETS];
+
+  /* The number of calls to "brk" and the total time spent in them. */
+  size_t brk_calls;
+  uint64_t brk_nanoseconds;
+
+  /*
+   * The number of garbage collections, the total time spent in them, and
+   * the number of blocks they freed.
+   */
+  size_t gc_collections;
+  uint64_t gc_nanoseconds;
+  size_t gc_blocks_freed;
+
+  /* The number of purges and the total number of bytes they released. */
+  size_t purges;
+  size_t purged_bytes;
+};
+
+/*
+ * Copy the current statistics into "stats". This returns 1 if statistics are
+ * being collected (with "-DBUDDY_STATS=1") and 0 otherwise, in which case all
+ * counters are zero.
+ */
+int buddy_get_stats(struct buddy_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef __cplusplus
+namespace buddy {
+
+/*
+ * A pointer to memory from this allocator that is stored as a 32-bit offset.
+ * It converts to and from "T *" and can be used mostly like one.
+ */
+template <typename T>
+class compressed_ptr {
+public:
+  compressed_ptr() : offset_(0) {}
+  compressed_ptr(T *ptr) : offset_(buddy_offset32(ptr)) {}
+
+  static compressed_ptr from_offset(uint32_t offset) {
+    compressed_ptr result;
+    result.offset_ = offset;
+    return result;
+  }
+
+  T *get() const { return static_cast<T *>(buddy_ptr32(offset_)); }
+  uint32_t offset() const { return offset_; }
+  operator T *() const { return get(); }
+  T &operator*() const { return *get(); }
+  T *operator->() const { return get(); }
+
+  bool operator==(compressed_ptr other) const { return offset_ == other.offset_; }
+  bool operator!=(compressed_ptr other) const { return offset_ != other.offset_; }
+
+private:
+  uint32_t offset_;
+};
+
+}
+#endif
+
+#endif
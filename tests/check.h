@@ -0,0 +1,19 @@
+/*
+ * A minimal assertion for the tests. It reports the failed condition and
+ * exits, so a test passes exactly when it returns 0 from "main".
+ */
+
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CHECK(condition) do { \
+  if (!(condition)) { \
+    printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+    exit(1); \
+  } \
+} while (0)
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ * Allocate many blocks through handles, free most of them so that the
+ * survivors are scattered over the heap, and run "buddy_compact" until it
+ * has nothing left to move. The survivors must keep their contents, pinned
+ * handles must stay where they are, and the freed space must merge enough
+ * that a large allocation fits without growing the heap.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <unistd.h>
+
+#include "../buddy-malloc.h"
+#include "check.h"
+
+#define COUNT 4096
+#define SIZE 1000
+#define KEEP_EVERY 16
+#define PINNED (COUNT / KEEP_EVERY / 2)
+#define LARGE (1024 * 1024)
+
+/*
+ * With "-DBUDDY_ENGINE=2", allocation takes the lowest free block that is big
+ * enough rather than an exact fit, which is usually next to another free
+ * block, so compaction moves next to nothing.
+ */
+#ifndef EXPECT_MERGE
+#define EXPECT_MERGE 1
+#endif
+
+static size_t handles[COUNT];
+static void *pinned[PINNED];
+static void *volatile large;
+
+static void fill(size_t i) {
+  memset(buddy_hpin(handles[i]), (int)(i % 251), SIZE);
+  buddy_hunpin(handles[i]);
+}
+
+static int check_contents(size_t i) {
+  unsigned char *ptr = buddy_hpin(handles[i]);
+  size_t j;
+  for (j = 0; j < SIZE && ptr[j] == i % 251; j++) {
+  }
+  buddy_hunpin(handles[i]);
+  return j == SIZE;
+}
+
+int main(void) {
+  size_t i, moved, total = 0, calls = 0;
+  char *brk_before;
+
+  for (i = 0; i < COUNT; i++) {
+    handles[i] = buddy_halloc(SIZE);
+    CHECK(handles[i]);
+    fill(i);
+  }
+
+  /*
+   * Freeing from the top down leaves the lowest holes at the front of the
+   * free lists, which is where the moved blocks go.
+   */
+  for (i = COUNT; i-- > 0;) {
+    if (i % KEEP_EVERY) {
+      buddy_hfree(handles[i]);
+      handles[i] = 0;
+    }
+  }
+
+  /*
+   * The survivors in the lower half stay pinned for the whole test, so the
+   * ones in the upper half have to move down next to them.
+   */
+  for (i = 0; i < PINNED; i++) {
+    pinned[i] = buddy_hpin(handles[i * KEEP_EVERY]);
+  }
+
+  do {
+    moved = buddy_compact(64 * 1024);
+    total += moved;
+    CHECK(++calls < 1000);
+  } while (moved);
+  CHECK(EXPECT_MERGE ? total >= PINNED * SIZE : total > 0);
+
+  for (i = 0; i < COUNT; i++) {
+    if (handles[i]) {
+      CHECK(check_contents(i));
+    }
+  }
+  for (i = 0; i < PINNED; i++) {
+    CHECK(buddy_hpin(handles[i * KEEP_EVERY]) == pinned[i]);
+    buddy_hunpin(handles[i * KEEP_EVERY]);
+    buddy_hunpin(handles[i * KEEP_EVERY]);
+  }
+
+  brk_before = sbrk(0);
+  large = malloc(LARGE);
+  CHECK(large);
+  CHECK((char *)sbrk(0) == brk_before || !EXPECT_MERGE);
+
+  free(large);
+  for (i = 0; i < COUNT; i++) {
+    if (handles[i]) {
+      buddy_hfree(handles[i]);
+    }
+  }
+  return 0;
+}
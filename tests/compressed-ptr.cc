@@ -0,0 +1,74 @@
+/*
+ * Build a linked list whose links are "buddy::compressed_ptr", check that
+ * every pointer survives the round trip through a 32-bit offset, and walk
+ * the list through the links. The links must be 4 bytes wide.
+ */
+
+#include <stddef.h>
+
+#include "../buddy-malloc.h"
+#include "check.h"
+
+#define COUNT 10000
+
+struct node {
+  buddy::compressed_ptr<node> next;
+  int value;
+};
+
+static node *nodes[COUNT];
+
+int main() {
+  buddy::compressed_ptr<node> head, empty((node *)NULL);
+  size_t i;
+  int value;
+
+  CHECK(sizeof(buddy::compressed_ptr<node>) == 4);
+  CHECK(sizeof(node) == 8);
+  CHECK(head.get() == NULL && head.offset() == 0);
+  CHECK(empty == head);
+
+  /*
+   * Mix in blocks of other sizes so that the nodes are spread over a
+   * larger heap.
+   */
+  for (i = 0; i < COUNT; i++) {
+    node *n = (node *)malloc(sizeof(node));
+    CHECK(n);
+    if (i % 7 == 0) {
+      free(malloc(i * 16));
+    }
+    n->value = (int)i;
+    n->next = head;
+    head = n;
+    nodes[i] = n;
+
+    CHECK(head.get() == n);
+    CHECK(static_cast<node *>(head) == n);
+    CHECK(head.offset() == buddy_offset32(n));
+    CHECK(buddy_ptr32(head.offset()) == n);
+    CHECK(buddy::compressed_ptr<node>::from_offset(head.offset()) == head);
+    CHECK(i == 0 || head != n->next);
+  }
+
+  value = COUNT;
+  for (buddy::compressed_ptr<node> p = head; p != empty; p = p->next) {
+    CHECK((*p).value == --value);
+    CHECK(p.get() == nodes[value]);
+  }
+  CHECK(value == 0);
+
+  /*
+   * Nodes can also be allocated and freed by offset.
+   */
+  head = buddy::compressed_ptr<node>::from_offset(buddy_malloc32(sizeof(node)));
+  CHECK(head.offset() != 0);
+  head->value = -1;
+  CHECK(nodes[0]->next == empty);
+  buddy_free32(head.offset());
+
+  for (i = 0; i < COUNT; i++) {
+    free(nodes[i]);
+  }
+  return 0;
+}
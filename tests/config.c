@@ -0,0 +1,78 @@
+/*
+ * Check the options read from "BUDDY_MALLOC_CONF", which "tests/run.sh"
+ * sets to CONF below, and reading and changing them with "buddy_ctl".
+ * Built with "-DBUDDY_STATS=1 -DBUDDY_RSS_LIMITS=1" so that those options
+ * exist too.
+ */
+
+#include <string.h>
+
+#include "../buddy-malloc.h"
+#include "check.h"
+
+#define CONF "placement:2,growth_max_log2:24,rss_soft_limit:512m,near_window_log2:99,bogus:3,thp:1x"
+
+static void *volatile block;
+
+static size_t get(const char *name) {
+  size_t value = 12345;
+  CHECK(buddy_ctl(name, &value, NULL) == 0);
+  return value;
+}
+
+static int set(const char *name, size_t value) {
+  return buddy_ctl(name, NULL, &value);
+}
+
+int main(void) {
+  struct buddy_stats stats;
+  size_t old_value, brk_calls;
+  const char *conf = getenv("BUDDY_MALLOC_CONF");
+
+  /* Valid entries apply, and out of range or malformed ones are ignored */
+  CHECK(conf && strcmp(conf, CONF) == 0);
+  CHECK(get("placement") == 2);
+  CHECK(get("growth_max_log2") == 24);
+  CHECK(get("rss_soft_limit") == (size_t)512 << 20);
+  CHECK(get("near_window_log2") <= 31);
+  CHECK(get("rss_hard_limit") == 0);
+#ifdef __linux__
+  CHECK(get("thp") == 0);
+#endif
+
+  /* Unknown names and values out of range fail and change nothing */
+  CHECK(buddy_ctl("bogus", &old_value, NULL) == -1);
+  CHECK(set("placement", 3) == -1 && get("placement") == 2);
+  CHECK(set("placement_large_log2", 1) == -1);
+  CHECK(set("stats", 2) == -1 && get("stats") == 1);
+
+  /* Setting returns the old value */
+  old_value = 0;
+  CHECK(buddy_ctl("placement", &old_value, &(size_t){ 1 }) == 0);
+  CHECK(old_value == 2 && get("placement") == 1);
+
+  /* The copy thresholds have minimums that keep the kernels safe */
+#if defined(__x86_64__) && defined(__GNUC__)
+  CHECK(set("stream_min_log2", 6) == -1 && set("stream_min_log2", 7) == 0);
+#endif
+#ifdef __linux__
+  CHECK(set("remap_min_log2", 11) == -1 && set("remap_min_log2", 12) == 0);
+#endif
+
+  /* "stats:0" pauses the counters */
+  CHECK(set("stats", 0) == 0);
+  buddy_get_stats(&stats);
+  brk_calls = stats.brk_calls;
+  block = malloc(100 << 20);
+  CHECK(block);
+  free(block);
+  buddy_get_stats(&stats);
+  CHECK(stats.brk_calls == brk_calls);
+  CHECK(set("stats", 1) == 0);
+  block = malloc(400 << 20);
+  CHECK(block);
+  free(block);
+  buddy_get_stats(&stats);
+  CHECK(stats.brk_calls > brk_calls);
+  return 0;
+}
@@ -0,0 +1,110 @@
+/*
+ * Queue blocks with "free_deferred" and count the live blocks with
+ * "buddy_iterate" to see when they are really freed: not before the queue
+ * fills up, all at once when it does, and the rest on "buddy_tick" and
+ * "buddy_flush_deferred". Built with "-DBUDDY_THREADS=1", several threads
+ * queue blocks at once while the background thread empties the queues, and
+ * a flush must leave nothing behind.
+ */
+
+#include <stdint.h>
+
+#include "../buddy-malloc.h"
+#include "check.h"
+
+#if BUDDY_THREADS
+#include <pthread.h>
+#endif
+
+#ifndef BUDDY_DEFER_LOG2
+#define BUDDY_DEFER_LOG2 8
+#endif
+
+#define QUEUE ((size_t)1 << BUDDY_DEFER_LOG2)
+#define THREADS 4
+#define BASE 3000
+
+/*
+ * The test's blocks have sizes from BASE to BASE + 199, so that memory the C
+ * library allocates for itself (for new threads, for example) isn't counted.
+ */
+static void count_block(void *ptr, size_t size, void *arg) {
+  (void)ptr;
+  if (size >= BASE && size < BASE + 200) {
+    ++*(size_t *)arg;
+  }
+}
+
+static size_t live_blocks(void) {
+  size_t count = 0;
+  buddy_iterate(NULL, SIZE_MAX, count_block, &count);
+  return count;
+}
+
+#if BUDDY_THREADS
+static void *queue_blocks(void *arg) {
+  size_t i;
+  (void)arg;
+  for (i = 0; i < QUEUE * 20; i++) {
+    void *block = malloc((size_t)(BASE + i % 200));
+    CHECK(block);
+    free_deferred(block);
+  }
+  return NULL;
+}
+#endif
+
+int main(void) {
+  static void *blocks[QUEUE * 2];
+  size_t before, i;
+
+  free_deferred(NULL);
+  before = live_blocks();
+  for (i = 0; i < QUEUE * 2; i++) {
+    blocks[i] = malloc(BASE + i % 100);
+    CHECK(blocks[i]);
+  }
+  CHECK(live_blocks() == before + QUEUE * 2);
+
+#if BUDDY_THREADS
+  {
+    pthread_t threads[THREADS];
+    int t;
+
+    for (i = 0; i < QUEUE * 2; i++) {
+      free_deferred(blocks[i]);
+    }
+    for (t = 0; t < THREADS; t++) {
+      CHECK(pthread_create(&threads[t], NULL, queue_blocks, NULL) == 0);
+    }
+    for (t = 0; t < THREADS; t++) {
+      pthread_join(threads[t], NULL);
+    }
+  }
+#else
+  /*
+   * A full queue holds QUEUE blocks. The next block empties it first.
+   */
+  for (i = 0; i < QUEUE; i++) {
+    free_deferred(blocks[i]);
+  }
+  CHECK(live_blocks() == before + QUEUE * 2);
+  free_deferred(blocks[QUEUE]);
+  CHECK(live_blocks() == before + QUEUE);
+
+  for (i = QUEUE + 1; i < QUEUE + 10; i++) {
+    free_deferred(blocks[i]);
+  }
+  CHECK(live_blocks() == before + QUEUE);
+  buddy_tick();
+  CHECK(live_blocks() == before + QUEUE - 10);
+
+  for (i = QUEUE + 10; i < QUEUE * 2; i++) {
+    free_deferred(blocks[i]);
+  }
+#endif
+
+  buddy_flush_deferred();
+  CHECK(live_blocks() == before);
+  return 0;
+}
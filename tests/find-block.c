@@ -0,0 +1,101 @@
+/*
+ * Look up pointers into live blocks, just past them and near them with
+ * "buddy_find_block" while blocks come and go, and check the answers
+ * against the blocks the test knows about. "buddy_iterate" must visit
+ * exactly those blocks too.
+ */
+
+#include <stdint.h>
+
+#include "../buddy-malloc.h"
+#include "check.h"
+
+#define SLOTS 2000
+#define STEPS 40000
+
+static char *blocks[SLOTS];
+static size_t sizes[SLOTS];
+static size_t visited, visited_bytes;
+
+static int owner(const char *ptr) {
+  int slot;
+  for (slot = 0; slot < SLOTS; slot++) {
+    if (blocks[slot] && ptr >= blocks[slot] &&
+        (ptr < blocks[slot] + sizes[slot] || ptr == blocks[slot])) {
+      return slot;
+    }
+  }
+  return -1;
+}
+
+static void visit(void *ptr, size_t size, void *arg) {
+  int slot = owner((char *)ptr);
+  (void)arg;
+  CHECK(slot >= 0 && blocks[slot] == ptr && sizes[slot] == size);
+  visited++;
+  visited_bytes += size;
+}
+
+static void check_all(void) {
+  size_t slot, live = 0, live_bytes = 0, i;
+  void *start;
+  size_t size;
+
+  for (slot = 0; slot < SLOTS; slot++) {
+    if (!blocks[slot]) continue;
+    live++;
+    live_bytes += sizes[slot];
+    CHECK(buddy_find_block(blocks[slot] + (sizes[slot] ? (size_t)rand() % sizes[slot] : 0), &start, &size));
+    CHECK(start == blocks[slot] && size == sizes[slot]);
+    if (sizes[slot] && buddy_find_block(blocks[slot] + sizes[slot], &start, &size)) {
+      CHECK(start != blocks[slot]);
+    }
+  }
+
+  /* Any pointer near a block is either inside the block that owns it or in none */
+  for (i = 0; i < 20000; i++) {
+    char *ptr;
+    int found;
+    slot = (size_t)rand() % SLOTS;
+    if (!blocks[slot]) continue;
+    ptr = blocks[slot] + rand() % 200000 - 100000;
+    found = owner(ptr);
+    if (buddy_find_block(ptr, &start, &size)) {
+      CHECK(found >= 0 && start == blocks[found] && size == sizes[found]);
+    } else {
+      CHECK(found < 0);
+    }
+  }
+
+  visited = visited_bytes = 0;
+  buddy_iterate(NULL, SIZE_MAX, visit, NULL);
+  CHECK(visited == live && visited_bytes == live_bytes);
+}
+
+int main(void) {
+  size_t step, slot, size;
+
+  srand(3);
+  for (step = 0; step < STEPS; step++) {
+    slot = (size_t)rand() % SLOTS;
+    if (!blocks[slot]) {
+      size = rand() % 8 ? (size_t)rand() % 100 : (size_t)rand() % 70000;
+      blocks[slot] = (char *)malloc(size);
+      CHECK(blocks[slot]);
+      sizes[slot] = size;
+    } else if (rand() % 4) {
+      free(blocks[slot]);
+      blocks[slot] = NULL;
+    } else {
+      size = (size_t)rand() % 9000 + 1;
+      blocks[slot] = (char *)realloc(blocks[slot], size);
+      CHECK(blocks[slot]);
+      sizes[slot] = size;
+    }
+    if (step % 4000 == 0) {
+      check_all();
+    }
+  }
+  check_all();
+  return 0;
+}
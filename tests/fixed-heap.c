@@ -0,0 +1,69 @@
+/*
+ * With "-DBUDDY_FIXED_HEAP_LOG2=24", the heap is all there before "main"
+ * runs. Check that allocating never moves the break, that allocations fail
+ * once the 16mb are used up, and that freeing everything makes the whole
+ * heap available again.
+ */
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../buddy-malloc.h"
+#include "check.h"
+
+#define HEAP_SIZE ((size_t)1 << 24)
+#define MAX_BLOCKS (HEAP_SIZE / 16)
+
+static void *blocks[MAX_BLOCKS];
+
+static size_t fill(size_t size) {
+  size_t count = 0;
+  while ((blocks[count] = malloc(size))) {
+    CHECK(++count < MAX_BLOCKS);
+  }
+  return count;
+}
+
+static void empty(size_t count) {
+  while (count) {
+    free(blocks[--count]);
+  }
+}
+
+int main(void) {
+  char *end = (char *)sbrk(0);
+  size_t first, count;
+  void *large;
+
+  CHECK(buddy_heap_base);
+  CHECK(end - buddy_heap_base >= (ptrdiff_t)HEAP_SIZE);
+
+  /* Blocks of 64 bytes fill almost all of the heap */
+  first = fill(56);
+  CHECK(first > HEAP_SIZE / 64 * 9 / 10);
+  blocks[first] = malloc(HEAP_SIZE);
+  CHECK(!blocks[first]);
+  CHECK((char *)sbrk(0) == end);
+  empty(first);
+
+  /* Everything merged back together, so the same blocks fit again */
+  count = fill(56);
+  CHECK(count == first);
+  empty(count);
+
+  /* Half the heap is one block, even after mixed use */
+  count = fill(3000);
+  CHECK(count > 0);
+  empty(count);
+  large = malloc(HEAP_SIZE / 2 - 64);
+  CHECK(large);
+  memset(large, 1, HEAP_SIZE / 2 - 64);
+  large = realloc(large, 100);
+  CHECK(large);
+  free(large);
+  CHECK((char *)sbrk(0) == end);
+  return 0;
+}
@@ -0,0 +1,117 @@
+/*
+ * Build lists of collectable blocks that are reachable from a global, from
+ * an ordinary allocation, through an interior pointer and not at all, and
+ * check which of them "buddy_gc_collect" frees. Roots are found
+ * conservatively, so a stale copy of a pointer may keep some garbage alive,
+ * and the counts only need to be close for unreachable blocks.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "../buddy-malloc.h"
+#include "check.h"
+
+#define KEPT 10000
+#define GARBAGE 100000
+#define HELD 64
+
+struct node {
+  struct node *next;
+  char padding[40];
+};
+
+static struct node *kept_list;
+
+static void __attribute__((noinline)) make_garbage(int count) {
+  struct node *volatile head = NULL;
+  int i;
+  for (i = 0; i < count; i++) {
+    struct node *node = (struct node *)buddy_gc_malloc(sizeof(struct node) + (i % 7) * 100);
+    CHECK(node);
+    node->next = head;
+    head = node;
+  }
+}
+
+static void __attribute__((noinline)) make_kept(int count) {
+  int i;
+  for (i = 0; i < count; i++) {
+    struct node *node = (struct node *)buddy_gc_malloc(sizeof(struct node));
+    CHECK(node);
+    node->next = kept_list;
+    kept_list = node;
+  }
+}
+
+static int __attribute__((noinline)) list_length(void) {
+  struct node *node;
+  int count = 0;
+  for (node = kept_list; node; node = node->next) count++;
+  return count;
+}
+
+static void __attribute__((noinline)) clear_stack(void) {
+  volatile char buffer[4096];
+  memset((char *)buffer, 0, sizeof(buffer));
+}
+
+int main(void) {
+  void **held;
+  char *interior;
+  void *start;
+  size_t size, freed;
+  int i;
+
+  make_kept(KEPT);
+  make_garbage(GARBAGE);
+
+  /* Blocks that are only reachable from an ordinary allocation */
+  held = (void **)malloc(HELD * sizeof(void *));
+  CHECK(held);
+  for (i = 0; i < HELD; i++) {
+    held[i] = buddy_gc_malloc(5000);
+    CHECK(held[i]);
+  }
+
+  /* A block that is only reachable through a pointer into its middle */
+  interior = (char *)buddy_gc_malloc(1000) + 500;
+
+  clear_stack();
+  freed = buddy_gc_collect();
+  CHECK(freed >= GARBAGE - 100 && freed <= GARBAGE);
+  CHECK(list_length() == KEPT);
+  for (i = 0; i < HELD; i++) {
+    CHECK(buddy_find_block(held[i], &start, &size) && size == 5000);
+    memset(held[i], 1, 5000);
+  }
+  CHECK(buddy_find_block(interior, &start, &size) && size == 1000);
+
+  /* Dropping the head of the list frees just those blocks */
+  kept_list = kept_list->next->next;
+  clear_stack();
+  CHECK(buddy_gc_collect() <= 2);
+  CHECK(list_length() == KEPT - 2);
+
+  /* A stale pointer into the list keeps the rest of it alive */
+  kept_list = NULL;
+  clear_stack();
+  freed = buddy_gc_collect();
+  CHECK(freed >= KEPT / 2 && freed <= KEPT);
+
+  free(held);
+  clear_stack();
+  freed = buddy_gc_collect();
+  CHECK(freed >= HELD - 2 && freed <= HELD);
+
+  /* Ordinary allocations are never collected */
+  held = (void **)malloc(100);
+  CHECK(held);
+  held = (void **)((uintptr_t)held ^ 1);
+  clear_stack();
+  buddy_gc_collect();
+  held = (void **)((uintptr_t)held ^ 1);
+  CHECK(buddy_find_block(held, &start, &size) && size == 100);
+  free(held);
+  return 0;
+}
@@ -0,0 +1,135 @@
+/*
+ * Keep a known set of live blocks of many sizes while blocks come and go,
+ * and check that "buddy_iterate" reports exactly that set (plus whatever
+ * was already allocated when the test started) with the right sizes, both
+ * for the whole heap and for ranges that cut through the middle of it.
+ */
+
+#include <stdint.h>
+
+#include "../buddy-malloc.h"
+#include "check.h"
+
+#define SLOTS 3000
+#define STEPS 60000
+#define EARLY 64
+
+typedef struct {
+  char *ptr;
+  size_t size;
+} block_t;
+
+static block_t live[SLOTS];
+static block_t early[EARLY];
+static block_t expected[SLOTS + EARLY];
+static block_t reported[SLOTS + EARLY];
+static size_t early_count, reported_count;
+
+static void record(void *ptr, size_t size, void *arg) {
+  block_t *blocks = (block_t *)arg;
+  size_t *count = blocks == early ? &early_count : &reported_count;
+  CHECK(*count < (blocks == early ? EARLY : SLOTS + EARLY));
+  blocks[*count].ptr = (char *)ptr;
+  blocks[(*count)++].size = size;
+}
+
+static int compare_blocks(const void *a, const void *b) {
+  const char *x = ((const block_t *)a)->ptr, *y = ((const block_t *)b)->ptr;
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * Check the blocks reported in the range of "size" bytes from "start"
+ * against the expected ones in that range.
+ */
+static void check_range(char *start, size_t size) {
+  uintptr_t end = size > UINTPTR_MAX - (uintptr_t)start ? UINTPTR_MAX : (uintptr_t)start + size;
+  size_t count = 0, slot;
+
+  for (slot = 0; slot < early_count; slot++) {
+    if (early[slot].ptr >= start && (uintptr_t)early[slot].ptr < end) {
+      expected[count++] = early[slot];
+    }
+  }
+  for (slot = 0; slot < SLOTS; slot++) {
+    if (live[slot].ptr && live[slot].ptr >= start && (uintptr_t)live[slot].ptr < end) {
+      expected[count++] = live[slot];
+    }
+  }
+
+  reported_count = 0;
+  CHECK(buddy_iterate(start, size, record, reported) == count);
+  CHECK(reported_count == count);
+  qsort(expected, count, sizeof(block_t), compare_blocks);
+  qsort(reported, count, sizeof(block_t), compare_blocks);
+  for (slot = 0; slot < count; slot++) {
+    CHECK(reported[slot].ptr == expected[slot].ptr);
+    CHECK(reported[slot].size == expected[slot].size);
+  }
+}
+
+static void check_all(void) {
+  char *low = (char *)UINTPTR_MAX, *high = NULL;
+  size_t slot;
+
+  check_range(NULL, SIZE_MAX);
+
+  for (slot = 0; slot < SLOTS; slot++) {
+    if (live[slot].ptr && live[slot].ptr < low) low = live[slot].ptr;
+    if (live[slot].ptr && live[slot].ptr > high) high = live[slot].ptr;
+  }
+  if (high) {
+    check_range(low, (size_t)(high - low) / 3);
+    check_range(low + (high - low) / 3, (size_t)(high - low));
+    check_range(high, 1);
+  }
+}
+
+int main(void) {
+  size_t step, slot, size;
+
+  buddy_iterate(NULL, SIZE_MAX, record, early);
+
+  srand(5);
+  for (step = 0; step < STEPS; step++) {
+    slot = (size_t)rand() % SLOTS;
+    if (live[slot].ptr && rand() % 3) {
+      free(live[slot].ptr);
+      live[slot].ptr = NULL;
+      continue;
+    }
+    switch (rand() % 8) {
+    case 0:
+      size = (size_t)rand() % 200000;
+      break;
+    case 1:
+    case 2:
+      size = (size_t)rand() % 4000;
+      break;
+    default:
+      size = (size_t)rand() % 64;
+      break;
+    }
+    if (live[slot].ptr) {
+      live[slot].ptr = (char *)realloc(live[slot].ptr, size + 1);
+      size++;
+    } else if (rand() % 4 == 0) {
+      live[slot].ptr = (char *)calloc(1, size);
+    } else {
+      live[slot].ptr = (char *)malloc(size);
+    }
+    CHECK(live[slot].ptr);
+    live[slot].size = size;
+    if (step % 5000 == 0) {
+      check_all();
+    }
+  }
+  check_all();
+
+  for (slot = 0; slot < SLOTS; slot++) {
+    free(live[slot].ptr);
+    live[slot].ptr = NULL;
+  }
+  check_all();
+  return 0;
+}
@@ -0,0 +1,112 @@
+/*
+ * Interleave short-lived and long-lived allocations of many sizes with
+ * "malloc_lifetime" and check that no page holds blocks of both classes,
+ * i.e. that the classes live in disjoint subtrees. Then free every
+ * short-lived block and check that the pages they were on hold nothing at
+ * all, so all of that memory has merged back into whole free pages.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "../buddy-malloc.h"
+#include "check.h"
+
+#define COUNT 4000
+
+/*
+ * The heap starts on a page boundary, and a region is at least a page
+ * unless "-DBUDDY_LIFETIME_REGION_LOG2" makes it smaller.
+ */
+#define PAGE 4096
+
+static char *short_blocks[COUNT], *long_blocks[COUNT];
+static size_t short_sizes[COUNT], long_sizes[COUNT];
+static uintptr_t short_pages[COUNT * 2], long_pages[COUNT * 2];
+
+static size_t random_size(void) {
+  switch (rand() % 16) {
+  case 0:
+    return (size_t)rand() % 3000 + 1;
+  case 1:
+  case 2:
+    return (size_t)rand() % 500 + 1;
+  default:
+    return (size_t)rand() % 100 + 1;
+  }
+}
+
+static int compare_pages(const void *a, const void *b) {
+  uintptr_t x = *(const uintptr_t *)a, y = *(const uintptr_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * Record the first and last page of a block, sort them, and drop the
+ * duplicates. None of the sizes span more than two pages.
+ */
+static size_t record_pages(char **blocks, size_t *sizes, uintptr_t *pages) {
+  size_t count = 0, unique = 0, i;
+
+  for (i = 0; i < COUNT; i++) {
+    pages[count++] = (uintptr_t)blocks[i] / PAGE;
+    pages[count++] = ((uintptr_t)blocks[i] + sizes[i] - 1) / PAGE;
+  }
+  qsort(pages, count, sizeof(uintptr_t), compare_pages);
+  for (i = 0; i < count; i++) {
+    if (unique == 0 || pages[i] != pages[unique - 1]) {
+      pages[unique++] = pages[i];
+    }
+  }
+  return unique;
+}
+
+static void ignore_block(void *ptr, size_t size, void *arg) {
+  (void)ptr;
+  (void)size;
+  (void)arg;
+}
+
+int main(void) {
+  size_t short_count, long_count, i, j;
+
+  srand(7);
+  for (i = 0; i < COUNT; i++) {
+    short_sizes[i] = random_size();
+    short_blocks[i] = malloc_lifetime(short_sizes[i], BUDDY_LIFETIME_SHORT);
+    CHECK(short_blocks[i]);
+    long_sizes[i] = random_size();
+    long_blocks[i] = malloc_lifetime(long_sizes[i], BUDDY_LIFETIME_LONG);
+    CHECK(long_blocks[i]);
+    memset(long_blocks[i], (int)(i % 251), long_sizes[i]);
+  }
+
+  short_count = record_pages(short_blocks, short_sizes, short_pages);
+  long_count = record_pages(long_blocks, long_sizes, long_pages);
+  for (i = 0, j = 0; i < short_count; i++) {
+    while (j < long_count && long_pages[j] < short_pages[i]) {
+      j++;
+    }
+    CHECK(j == long_count || long_pages[j] != short_pages[i]);
+  }
+
+  /*
+   * Free the short-lived blocks in a scrambled order. Afterward, every page
+   * they were on must be empty.
+   */
+  for (i = 0; i < COUNT; i++) {
+    j = (i * 1237) % COUNT;
+    free(short_blocks[j]);
+  }
+  for (i = 0; i < short_count; i++) {
+    CHECK(buddy_iterate((void *)(short_pages[i] * PAGE), PAGE, ignore_block, NULL) == 0);
+  }
+
+  for (i = 0; i < COUNT; i++) {
+    for (j = 0; j < long_sizes[i] && (unsigned char)long_blocks[i][j] == i % 251; j++) {
+    }
+    CHECK(j == long_sizes[i]);
+    free(long_blocks[i]);
+  }
+  return 0;
+}
@@ -0,0 +1,57 @@
+/*
+ * Free many small blocks with "-DBUDDY_MERGE_STEPS" so that most merges are
+ * left for later, then check that "buddy_tick" finishes them and that a
+ * large allocation finishes them itself instead of growing the heap.
+ */
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+
+#include "../buddy-malloc.h"
+#include "check.h"
+
+#define COUNT 65536
+#define LARGE (512 * 1024)
+
+static void *blocks[COUNT];
+
+static void fill_and_free(void) {
+  size_t i;
+  for (i = 0; i < COUNT; i++) {
+    blocks[i] = malloc(8);
+    CHECK(blocks[i]);
+  }
+  for (i = 0; i < COUNT; i++) {
+    free(blocks[i]);
+  }
+}
+
+int main(void) {
+  void *large;
+  char *end;
+  size_t ticks = 0;
+
+  /* "buddy_tick" does a bounded amount of work and then stops */
+  fill_and_free();
+  end = (char *)sbrk(0);
+  while (buddy_tick()) {
+    ticks++;
+    CHECK(ticks < COUNT * 2);
+  }
+  CHECK(ticks > 0);
+  CHECK(!buddy_tick());
+  large = malloc(LARGE);
+  CHECK(large);
+  CHECK((char *)sbrk(0) == end);
+  free(large);
+
+  /* Without ticks, the large allocation has to merge what's parked */
+  fill_and_free();
+  end = (char *)sbrk(0);
+  large = malloc(LARGE);
+  CHECK(large);
+  CHECK((char *)sbrk(0) == end);
+  free(large);
+  return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * Move blocks of many sizes with "realloc" between neighbors that stay
+ * allocated, and check that the moved data and the neighbors are intact.
+ * "mremap" is wrapped to count the calls, so the test also checks whether
+ * large blocks were moved by remapping their pages ("-DEXPECT_REMAP=1") or
+ * by copying ("-DEXPECT_REMAP=0").
+ */
+
+#define _GNU_SOURCE
+
+#include <stdarg.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "../buddy-malloc.h"
+#include "check.h"
+
+#ifndef EXPECT_REMAP
+#define EXPECT_REMAP 1
+#endif
+
+#define COUNT 16
+
+static size_t remaps;
+
+void *__real_mremap(void *old_address, size_t old_size, size_t new_size, int flags, ...);
+
+void *__wrap_mremap(void *old_address, size_t old_size, size_t new_size, int flags, ...) {
+  void *new_address;
+  va_list args;
+  va_start(args, flags);
+  new_address = va_arg(args, void *);
+  va_end(args);
+  remaps++;
+  return __real_mremap(old_address, old_size, new_size, flags, new_address);
+}
+
+static unsigned char *blocks[COUNT];
+
+static void check_filled(size_t index, size_t size) {
+  size_t i;
+  for (i = 0; i < size; i++) {
+    CHECK(blocks[index][i] == (unsigned char)(index + 1));
+  }
+}
+
+int main(void) {
+  static const size_t sizes[] = { 100, 3000, 5000, 9000, 70000, 1 << 20, (1 << 20) + 123, 3 << 20 };
+  size_t s, i;
+
+  for (s = 0; s < sizeof(sizes) / sizeof(*sizes); s++) {
+    for (i = 0; i < COUNT; i++) {
+      blocks[i] = (unsigned char *)malloc(sizes[s]);
+      CHECK(blocks[i]);
+      memset(blocks[i], (int)(i + 1), sizes[s]);
+    }
+
+    /* Grow every other block so it has to move past its neighbors */
+    for (i = 0; i < COUNT; i += 2) {
+      blocks[i] = (unsigned char *)realloc(blocks[i], sizes[s] * 3);
+      CHECK(blocks[i]);
+      check_filled(i, sizes[s]);
+      memset(blocks[i] + sizes[s], (int)(i + 1), sizes[s] * 2);
+    }
+    for (i = 0; i < COUNT; i++) {
+      check_filled(i, i % 2 ? sizes[s] : sizes[s] * 3);
+      free(blocks[i]);
+    }
+  }
+
+  CHECK(EXPECT_REMAP ? remaps > 0 : remaps == 0);
+  return 0;
+}
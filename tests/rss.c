@@ -0,0 +1,112 @@
+/*
+ * Check that "buddy_purge" gives free memory back to the kernel and lowers
+ * the break, that memory given back reads as zero, and that an allocation
+ * at the hard limit calls the pressure callback and succeeds once the
+ * callback has freed enough.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../buddy-malloc.h"
+#include "check.h"
+
+#define COUNT 256
+#define SIZE 100000
+#define CACHED 64
+
+static char *blocks[COUNT];
+static void *cache[CACHED];
+static int callback_calls;
+
+/*
+ * Return the resident set size in bytes, reading it without stdio so that
+ * measuring doesn't allocate.
+ */
+static size_t resident_bytes(void) {
+  char buffer[128];
+  unsigned long pages, resident;
+  int fd = open("/proc/self/statm", O_RDONLY);
+  ssize_t length;
+  CHECK(fd >= 0);
+  length = read(fd, buffer, sizeof(buffer) - 1);
+  close(fd);
+  CHECK(length > 0);
+  buffer[length] = '\0';
+  CHECK(sscanf(buffer, "%lu %lu", &pages, &resident) == 2);
+  return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static void drop_cache(size_t size) {
+  int i;
+  (void)size;
+  callback_calls++;
+  for (i = 0; i < CACHED; i++) {
+    free(cache[i]);
+    cache[i] = NULL;
+  }
+}
+
+int main(void) {
+  size_t before, after, i, j;
+  void *large, *larger;
+
+  /* Free most of 25mb of touched memory and purge it */
+  for (i = 0; i < COUNT; i++) {
+    blocks[i] = (char *)malloc(SIZE);
+    CHECK(blocks[i]);
+    memset(blocks[i], 1, SIZE);
+  }
+  before = resident_bytes();
+  for (i = 0; i < COUNT; i++) {
+    if (i % 8) {
+      free(blocks[i]);
+    }
+  }
+  CHECK(buddy_purge() > 0);
+  after = resident_bytes();
+  CHECK(after + COUNT * SIZE / 2 < before);
+
+  /* With everything free, the break goes back down */
+  for (i = 0; i < COUNT; i += 8) {
+    free(blocks[i]);
+  }
+  buddy_purge();
+  CHECK((size_t)((char *)sbrk(0) - buddy_heap_base) < COUNT * SIZE / 8);
+
+  /* Memory that was given back has to be zero for "calloc" */
+  for (i = 0; i < COUNT; i++) {
+    blocks[i] = (char *)calloc(1, SIZE);
+    CHECK(blocks[i]);
+    for (j = 0; j < SIZE; j++) {
+      CHECK(blocks[i][j] == 0);
+    }
+    memset(blocks[i], 3, SIZE);
+  }
+  for (i = 0; i < COUNT; i++) {
+    free(blocks[i]);
+  }
+
+  /* At the hard limit, the callback frees the cache and the retry works */
+  buddy_set_rss_limits(8 << 20, 40 << 20);
+  buddy_set_pressure_callback(drop_cache);
+  for (i = 0; i < CACHED; i++) {
+    cache[i] = malloc(200000);
+    CHECK(cache[i]);
+    memset(cache[i], 1, 200000);
+  }
+  large = malloc(12 << 20);
+  CHECK(large);
+  larger = malloc(12 << 20);
+  CHECK(larger);
+  CHECK(callback_calls > 0);
+  cache[0] = malloc(64 << 20);
+  CHECK(!cache[0]);
+  free(large);
+  free(larger);
+  return 0;
+}
@@ -0,0 +1,147 @@
+#!/bin/sh
+#
+# Build each test against the allocator once per configuration it covers
+# and run it. Set CC or CFLAGS (CXX or CXXFLAGS for the C++ tests) to
+# override the compiler and its flags, and M32=1 to build everything as
+# 32-bit programs with "-DBUDDY_ILP32=1".
+#
+
+cd "$(dirname "$0")"
+
+CC=${CC:-cc}
+CXX=${CXX:-c++}
+CFLAGS=${CFLAGS:--O2 -std=c99 -Wall}
+CXXFLAGS=${CXXFLAGS:--O2 -Wall}
+if [ "$M32" = 1 ]; then
+  CFLAGS="$CFLAGS -m32 -DBUDDY_ILP32=1"
+  CXXFLAGS="$CXXFLAGS -m32 -DBUDDY_ILP32=1"
+fi
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+FAILED=0
+
+# Usage: run <BUDDY_MALLOC_CONF> <test> [compiler flags...]
+run() {
+  conf=$1
+  name=$2
+  shift 2
+  label="$*${conf:+ $conf}"
+  printf '%-12s %-52s ' "$name" "${label# }"
+  if $CC $CFLAGS "$@" -o "$OUT/$name" ../buddy-malloc.c "$name.c" &&
+      BUDDY_MALLOC_CONF=$conf "$OUT/$name"; then
+    echo ok
+  else
+    echo FAILED
+    FAILED=1
+  fi
+}
+
+# Usage: run_cxx <BUDDY_MALLOC_CONF> <test> [compiler flags...]
+# Builds the allocator as C and the test, a ".cc" file, as C++.
+run_cxx() {
+  conf=$1
+  name=$2
+  shift 2
+  label="$*${conf:+ $conf}"
+  printf '%-12s %-52s ' "$name" "${label# }"
+  if $CC $CFLAGS "$@" -c -o "$OUT/buddy-malloc.o" ../buddy-malloc.c &&
+      $CXX $CXXFLAGS "$@" -o "$OUT/$name" "$OUT/buddy-malloc.o" "$name.cc" &&
+      BUDDY_MALLOC_CONF=$conf "$OUT/$name"; then
+    echo ok
+  else
+    echo FAILED
+    FAILED=1
+  fi
+}
+
+run "" stress
+run "" stress -DBUDDY_FREE_INDEX=1
+run "" stress -DBUDDY_ENGINE=1
+run "" stress -DBUDDY_ENGINE=2
+run "placement:1" stress
+run "placement:2" stress
+run "placement:1" stress -DBUDDY_ENGINE=1
+run "" stress -DBUDDY_BLOCKED_TREE=1 -DBUDDY_PRESERVE_LARGE=1
+run "" stress -DBUDDY_REFILL_LOG2=12 -DBUDDY_CACHE_COLORING=1
+run "" stress -DBUDDY_THREADS=1 -pthread
+run "" stress -DBUDDY_MERGE_STEPS=2
+run "" stress -DBUDDY_MERGE_STEPS=2 -DBUDDY_ENGINE=1
+
+run "" remap -Wl,--wrap=mremap
+run "" remap -Wl,--wrap=mremap -DBUDDY_ENGINE=1
+run "remap_min_log2:31" remap -Wl,--wrap=mremap -DEXPECT_REMAP=0
+run "" remap -Wl,--wrap=mremap -DBUDDY_REMAP_MIN_LOG2=0 -DEXPECT_REMAP=0
+run "" remap -Wl,--wrap=mremap -DBUDDY_FIXED_HEAP_LOG2=28 -DEXPECT_REMAP=0
+run "" stream -DBUDDY_STREAM_MIN_LOG2=7
+run "stream_min_log2:7" stream
+run "" stream -DBUDDY_STREAM_MIN_LOG2=7 -DBUDDY_CACHE_COLORING=1
+
+run "" find-block
+run "" find-block -DBUDDY_FREE_INDEX=1
+run "" find-block -DBUDDY_ENGINE=1
+run "" find-block -DBUDDY_ENGINE=2
+run "" find-block -DBUDDY_CACHE_COLORING=1 -DBUDDY_REFILL_LOG2=12
+run "" find-block -DBUDDY_MERGE_STEPS=2
+
+run "" iterate
+run "" iterate -DBUDDY_FREE_INDEX=1
+run "" iterate -DBUDDY_ENGINE=1
+run "" iterate -DBUDDY_ENGINE=2
+run "" iterate -DBUDDY_CACHE_COLORING=1 -DBUDDY_REFILL_LOG2=12
+run "" iterate -DBUDDY_MERGE_STEPS=2
+run "" iterate -DBUDDY_THREADS=1 -pthread
+
+run_cxx "" compressed-ptr
+run_cxx "" compressed-ptr -DBUDDY_ENGINE=2
+run_cxx "" compressed-ptr -DBUDDY_THREADS=1 -pthread
+
+run "" gc -DBUDDY_GC=1
+run "" gc -DBUDDY_GC=1 -DBUDDY_FREE_INDEX=1
+run "" gc -DBUDDY_GC=1 -DBUDDY_ENGINE=1
+run "" gc -DBUDDY_GC=1 -DBUDDY_ENGINE=2
+
+run "" compact
+run "placement:1" compact
+run "" compact -DBUDDY_ENGINE=1
+run "" compact -DBUDDY_ENGINE=2 -DEXPECT_MERGE=0
+run "" compact -DBUDDY_THREADS=1 -pthread
+
+run "" merge-steps -DBUDDY_MERGE_STEPS=4
+run "merge_steps:1" merge-steps -DBUDDY_MERGE_STEPS=4
+run "" merge-steps -DBUDDY_MERGE_STEPS=4 -DBUDDY_ENGINE=1
+run "placement:1" merge-steps -DBUDDY_MERGE_STEPS=4
+
+run "" fixed-heap -DBUDDY_FIXED_HEAP_LOG2=24
+run "" fixed-heap -DBUDDY_FIXED_HEAP_LOG2=24 -DBUDDY_ENGINE=1
+run "" fixed-heap -DBUDDY_FIXED_HEAP_LOG2=24 -DBUDDY_ENGINE=2
+run "" fixed-heap -DBUDDY_FIXED_HEAP_LOG2=24 -DBUDDY_MERGE_STEPS=2
+
+run "" tags -DBUDDY_TAGS=16
+run "" tags -DBUDDY_TAGS=16 -DBUDDY_ENGINE=1
+run "" tags -DBUDDY_TAGS=16 -DBUDDY_THREADS=1 -pthread
+
+run "" threads -DBUDDY_THREADS=1 -pthread
+run "" threads -DBUDDY_THREADS=1 -DBUDDY_MAX_THREADS=4 -pthread
+run "" threads -DBUDDY_THREADS=1 -DBUDDY_TAGS=16 -pthread
+
+run "" defer
+run "" defer -DBUDDY_DEFER_LOG2=4 -DBUDDY_ENGINE=1
+run "" defer -DBUDDY_MERGE_STEPS=2
+run "" defer -DBUDDY_THREADS=1 -pthread
+
+run "" lifetime
+run "placement:2" lifetime
+run "" lifetime -DBUDDY_ENGINE=1
+run "" lifetime -DBUDDY_ENGINE=2
+run "" lifetime -DBUDDY_LIFETIME_REGION_LOG2=12
+run "" lifetime -DBUDDY_THREADS=1 -pthread
+
+run "" rss -DBUDDY_RSS_LIMITS=1
+run "" rss -DBUDDY_RSS_LIMITS=1 -DBUDDY_ENGINE=1
+run "" rss -DBUDDY_RSS_LIMITS=1 -DBUDDY_THREADS=1 -pthread
+
+CONF=placement:2,growth_max_log2:24,rss_soft_limit:512m,near_window_log2:99,bogus:3,thp:1x
+run "$CONF" config -DBUDDY_STATS=1 -DBUDDY_RSS_LIMITS=1
+run "$CONF" config -DBUDDY_STATS=1 -DBUDDY_RSS_LIMITS=1 -DBUDDY_THREADS=1 -pthread
+
+exit $FAILED
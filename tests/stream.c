@@ -0,0 +1,43 @@
+/*
+ * Copy and clear blocks of every size up to a few pages with the streaming
+ * kernels. Built with "-DBUDDY_STREAM_MIN_LOG2=7", so every block of 128
+ * bytes or more goes through them, including the unaligned head and tail.
+ */
+
+#include <string.h>
+
+#include "../buddy-malloc.h"
+#include "check.h"
+
+#define MAX_SIZE 20000
+
+static unsigned char *volatile block;
+
+int main(void) {
+  size_t size, i;
+
+  for (size = 1; size <= MAX_SIZE; size += size < 1000 ? 1 : 97) {
+    /* Leave dirty memory behind for "calloc" to clear */
+    block = (unsigned char *)malloc(size);
+    CHECK(block);
+    memset(block, 0xAB, size);
+    free(block);
+    block = (unsigned char *)calloc(size, 1);
+    CHECK(block);
+    for (i = 0; i < size; i++) {
+      CHECK(block[i] == 0);
+    }
+
+    /* Grow the block so it has to move */
+    for (i = 0; i < size; i++) {
+      block[i] = (unsigned char)(i * 7 + size);
+    }
+    block = (unsigned char *)realloc(block, size * 2 + 1000);
+    CHECK(block);
+    for (i = 0; i < size; i++) {
+      CHECK(block[i] == (unsigned char)(i * 7 + size));
+    }
+    free(block);
+  }
+  return 0;
+}
@@ -0,0 +1,93 @@
+/*
+ * Random "malloc", "calloc", "realloc" and "free" calls with a pattern
+ * written into every block and checked before the block changes. This runs
+ * with every engine and placement policy, and as a 32-bit program.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "../buddy-malloc.h"
+#include "check.h"
+
+#define SLOTS 500
+#define STEPS 100000
+
+static unsigned char *blocks[SLOTS];
+static size_t sizes[SLOTS];
+
+static unsigned char pattern(size_t slot, size_t offset) {
+  return (unsigned char)(slot * 31 + offset);
+}
+
+static void fill(size_t slot) {
+  size_t i;
+  for (i = 0; i < sizes[slot]; i += 61) {
+    blocks[slot][i] = pattern(slot, i);
+  }
+}
+
+static void verify(size_t slot, size_t size) {
+  size_t i;
+  for (i = 0; i < size; i += 61) {
+    CHECK(blocks[slot][i] == pattern(slot, i));
+  }
+}
+
+static size_t random_size(void) {
+  switch (rand() % 16) {
+    case 0: return 0;
+    case 1: return (size_t)(rand() % 4 + 1) << 18;
+    case 2: case 3: return (size_t)rand() % 20000 + 1;
+    default: return (size_t)rand() % 200 + 1;
+  }
+}
+
+int main(void) {
+  size_t step, slot, size, i;
+  void *start;
+
+  srand(1);
+  for (step = 0; step < STEPS; step++) {
+    slot = (size_t)rand() % SLOTS;
+
+    if (!blocks[slot]) {
+      size = random_size();
+      if (rand() % 2) {
+        blocks[slot] = (unsigned char *)calloc(1, size);
+        CHECK(blocks[slot]);
+        for (i = 0; i < size; i++) {
+          CHECK(blocks[slot][i] == 0);
+        }
+      } else {
+        blocks[slot] = (unsigned char *)malloc(size);
+        CHECK(blocks[slot]);
+      }
+      sizes[slot] = size;
+      fill(slot);
+      continue;
+    }
+
+    verify(slot, sizes[slot]);
+    CHECK(buddy_find_block(blocks[slot] + sizes[slot] / 2, &start, &size));
+    CHECK(start == blocks[slot] && size == sizes[slot]);
+    CHECK(buddy_ptr32(buddy_offset32(blocks[slot])) == blocks[slot]);
+
+    if (rand() % 2) {
+      free(blocks[slot]);
+      blocks[slot] = NULL;
+    } else {
+      size = random_size();
+      blocks[slot] = (unsigned char *)realloc(blocks[slot], size ? size : 1);
+      CHECK(blocks[slot]);
+      verify(slot, size < sizes[slot] ? size : sizes[slot]);
+      sizes[slot] = size ? size : 1;
+      fill(slot);
+    }
+  }
+
+  for (slot = 0; slot < SLOTS; slot++) {
+    free(blocks[slot]);
+  }
+  return 0;
+}
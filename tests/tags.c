@@ -0,0 +1,125 @@
+/*
+ * Charge allocations to tags with "malloc_tagged" and the thread's tag,
+ * and check the usage per tag through "realloc" and "free", the quota
+ * callback and hard quotas. Built with "-DBUDDY_THREADS=1", several threads
+ * with their own tags also allocate at once.
+ */
+
+#include <stdint.h>
+
+#include "../buddy-malloc.h"
+#include "check.h"
+
+#if BUDDY_THREADS
+#include <pthread.h>
+#endif
+
+#define TAGS 16
+#define QUOTA_TAG 3
+
+static int callback_calls;
+
+/*
+ * The callback runs without the lock held, so it may use the allocator.
+ */
+static void over_quota(int tag, size_t bytes) {
+  void *block = malloc(100);
+  CHECK(tag == QUOTA_TAG && bytes > 4096);
+  CHECK(block && buddy_tag_usage(QUOTA_TAG) == bytes);
+  free(block);
+  callback_calls++;
+}
+
+/*
+ * Tag 0 is left out, since the C library's own allocations (for new threads,
+ * for example) are charged to it.
+ */
+static size_t total_usage(void) {
+  size_t total = 0;
+  int tag;
+  for (tag = 1; tag < TAGS; tag++) {
+    total += buddy_tag_usage(tag);
+  }
+  return total;
+}
+
+#if BUDDY_THREADS
+static void *worker(void *arg) {
+  int tag = (int)(intptr_t)arg, round, i;
+  void *blocks[100];
+  buddy_set_thread_tag(tag);
+  for (round = 0; round < 200; round++) {
+    for (i = 0; i < 100; i++) {
+      blocks[i] = malloc((size_t)(i * 37 % 3000 + 1));
+      CHECK(blocks[i]);
+    }
+    CHECK(buddy_tag_usage(tag) >= 100);
+    for (i = 0; i < 100; i++) {
+      blocks[i] = realloc(blocks[i], (size_t)(i * 53 % 5000 + 1));
+      CHECK(blocks[i]);
+    }
+    for (i = 0; i < 100; i++) {
+      free(blocks[i]);
+    }
+  }
+  return NULL;
+}
+#endif
+
+int main(void) {
+  void *blocks[64], *block;
+  int i, allowed = 0;
+
+  /* Usage follows one block through "realloc" and "free" */
+  CHECK(buddy_tag_usage(2) == 0);
+  block = malloc_tagged(100, 2);
+  CHECK(block && buddy_tag_usage(2) >= 100 && buddy_tag_usage(2) < 256);
+  block = realloc(block, 1000);
+  CHECK(block && buddy_tag_usage(2) >= 1000 && buddy_tag_usage(2) < 2048);
+  free(block);
+  CHECK(buddy_tag_usage(2) == 0);
+  CHECK(!malloc_tagged(8, TAGS));
+  CHECK(!malloc_tagged(8, -1));
+
+  /* The thread's tag applies to plain "malloc" */
+  buddy_set_thread_tag(5);
+  block = malloc(500);
+  CHECK(block && buddy_tag_usage(5) >= 500);
+  buddy_set_thread_tag(0);
+  free(block);
+  CHECK(buddy_tag_usage(5) == 0);
+
+  /* The soft quota calls back and the hard quota stops allocations */
+  buddy_set_quota_callback(over_quota);
+  buddy_set_tag_quota(QUOTA_TAG, 4096, 16384);
+  for (i = 0; i < 64; i++) {
+    blocks[i] = malloc_tagged(1000, QUOTA_TAG);
+    allowed += blocks[i] != NULL;
+  }
+  CHECK(allowed >= 4 && allowed <= 16);
+  CHECK(callback_calls > 0);
+  CHECK(buddy_tag_usage(QUOTA_TAG) <= 16384);
+  for (i = 0; i < 64; i++) {
+    free(blocks[i]);
+  }
+  CHECK(buddy_tag_usage(QUOTA_TAG) == 0);
+  buddy_set_tag_quota(QUOTA_TAG, 0, 0);
+
+#if BUDDY_THREADS
+  {
+    pthread_t threads[4];
+    for (i = 0; i < 4; i++) {
+      CHECK(pthread_create(&threads[i], NULL, worker, (void *)(intptr_t)(6 + i)) == 0);
+    }
+    for (i = 0; i < 4; i++) {
+      CHECK(pthread_join(threads[i], NULL) == 0);
+    }
+    for (i = 6; i < 10; i++) {
+      CHECK(buddy_tag_usage(i) == 0);
+    }
+  }
+#endif
+
+  CHECK(total_usage() == 0);
+  return 0;
+}
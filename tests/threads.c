@@ -0,0 +1,153 @@
+/*
+ * Allocate and free small blocks from several threads at once, then check
+ * that no cache line holds bytes of blocks allocated by two different
+ * threads. The threads wait for each other before exiting, since a thread
+ * that exits passes its lines on to the next one. Built with a small
+ * "-DBUDDY_MAX_THREADS", some threads run out of slots. Then fork while
+ * other threads keep allocating and check that each child can still
+ * allocate.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../buddy-malloc.h"
+#include "check.h"
+
+#define THREADS 8
+#define BLOCKS 2000
+#define LINE 64
+#define FORKS 50
+
+typedef struct {
+  uintptr_t line;
+  int thread;
+} line_owner_t;
+
+static char *blocks[THREADS][BLOCKS];
+static size_t sizes[THREADS][BLOCKS];
+static line_owner_t lines[THREADS * BLOCKS * 2];
+static pthread_barrier_t done;
+static volatile int stop;
+
+static void *allocate_blocks(void *arg) {
+  int thread = (int)(intptr_t)arg, round, i;
+  uint32_t random = 2463534242u + (uint32_t)thread;
+
+  for (round = 0; round < 20; round++) {
+    for (i = 0; i < BLOCKS; i++) {
+      random ^= random << 13;
+      random ^= random >> 17;
+      random ^= random << 5;
+      if (blocks[thread][i] && random % 2) {
+        free(blocks[thread][i]);
+        blocks[thread][i] = NULL;
+      }
+      if (!blocks[thread][i]) {
+        sizes[thread][i] = random % 48 + 1;
+        blocks[thread][i] = malloc(sizes[thread][i]);
+        CHECK(blocks[thread][i]);
+        blocks[thread][i][0] = (char)thread;
+      }
+    }
+  }
+  pthread_barrier_wait(&done);
+  return NULL;
+}
+
+static int compare_lines(const void *a, const void *b) {
+  uintptr_t x = ((const line_owner_t *)a)->line;
+  uintptr_t y = ((const line_owner_t *)b)->line;
+  return x < y ? -1 : x > y;
+}
+
+static void *churn(void *arg) {
+  void *block;
+  (void)arg;
+  do {
+    block = malloc(100);
+    CHECK(block);
+    free(block);
+    free_deferred(malloc(20));
+  } while (!stop);
+  return NULL;
+}
+
+int main(void) {
+  pthread_t threads[THREADS];
+  size_t count = 0, i;
+  int thread, fork_count, status;
+  pid_t pid;
+
+  pthread_barrier_init(&done, NULL, THREADS);
+  for (thread = 0; thread < THREADS; thread++) {
+    CHECK(pthread_create(&threads[thread], NULL, allocate_blocks, (void *)(intptr_t)thread) == 0);
+  }
+  for (thread = 0; thread < THREADS; thread++) {
+    pthread_join(threads[thread], NULL);
+  }
+
+  /*
+   * Record the first and last line of every block along with its thread.
+   * None of the sizes span more than two lines.
+   */
+  for (thread = 0; thread < THREADS; thread++) {
+    for (i = 0; i < BLOCKS; i++) {
+      uintptr_t start = (uintptr_t)blocks[thread][i];
+      lines[count].line = start / LINE;
+      lines[count++].thread = thread;
+      lines[count].line = (start + sizes[thread][i] - 1) / LINE;
+      lines[count++].thread = thread;
+    }
+  }
+  qsort(lines, count, sizeof(lines[0]), compare_lines);
+  for (i = 1; i < count; i++) {
+    CHECK(lines[i].line != lines[i - 1].line || lines[i].thread == lines[i - 1].thread);
+  }
+
+  /*
+   * Free the blocks from a different thread than the one that allocated them.
+   */
+  for (thread = 0; thread < THREADS; thread++) {
+    for (i = 0; i < BLOCKS; i++) {
+      CHECK(blocks[thread][i][0] == (char)thread);
+      free(blocks[thread][i]);
+    }
+  }
+
+  /*
+   * Each child gets 5 seconds before the alarm kills it, in case it's stuck
+   * on a lock that was held by another thread when it was forked.
+   */
+  for (thread = 0; thread < 4; thread++) {
+    CHECK(pthread_create(&threads[thread], NULL, churn, NULL) == 0);
+  }
+  for (fork_count = 0; fork_count < FORKS; fork_count++) {
+    pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0) {
+      void *block;
+      alarm(5);
+      block = malloc(1000);
+      free_deferred(malloc(30));
+      free(block);
+      stop = 1;
+      CHECK(pthread_create(&threads[0], NULL, churn, NULL) == 0);
+      pthread_join(threads[0], NULL);
+      _exit(0);
+    }
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+  stop = 1;
+  for (thread = 0; thread < 4; thread++) {
+    pthread_join(threads[thread], NULL);
+  }
+
+  return 0;
+}